@@ -26,6 +26,20 @@
 #define DISPLAY_WIDTH 128
 #define DISPLAY_HEIGHT 64
 
+// Native resolution of lores mode, whose pixels are 2x2 display pixels.
+#define LORES_WIDTH (DISPLAY_WIDTH / 2)
+#define LORES_HEIGHT (DISPLAY_HEIGHT / 2)
+
+// 64-bit words in a row of the packed display.
+#define DISPLAY_ROW_WORDS (DISPLAY_WIDTH / 64)
+
+/* Whether pixel x of a packed display row is on. Pixels are stored left to
+right starting at the most significant bit of the row's first word. */
+#define DISPLAY_PIXEL(row, x) ((((row)[(x) >> 6] >> (63 - ((x) & 63))) & 1) != 0)
+
+// Dirty-row mask with every row of the display set.
+#define DISPLAY_ALL_ROWS (~(uint64_t)0)
+
 #define NUM_KEYS 16
 #define NUM_REGISTERS 16
 #define NUM_USER_FLAGS 16
@@ -34,10 +48,20 @@
 #define NUM_FONT_BYTES 80
 #define NUM_BIG_FONT_BYTES 160
 
+// Bit of quirk n in the CHIP8 quirks mask.
+#define QUIRK(n) (1u << (n))
+
+/* Quirk masks of the common profiles. The libretro core defaults to the
+S-CHIP profile. */
+#define QUIRKS_SCHIP ((uint16_t)((1u << NUM_QUIRKS) - 1))
+#define QUIRKS_LEGACY ((uint16_t)QUIRK(6))
+#define QUIRKS_XOCHIP ((uint16_t)QUIRK(9))
+
 #define MAX_RAM 65536
 #define MAX_FILEPATH_LEN 256
 #define STACK_SIZE 16
 #define AUDIO_BUF_SIZE 16
+#define AUDIO_PATTERN_BITS (AUDIO_BUF_SIZE * 8)
 
 #define FONT_START_ADDR 0x0
 #define BIG_FONT_START_ADDR (FONT_START_ADDR + NUM_FONT_BYTES)
@@ -50,6 +74,9 @@
 #define TIMER_FREQ_DEFAULT 60
 #define PITCH_DEFAULT 64
 
+// Fractional bits of the fixed-point sound frequencies.
+#define SOUND_FREQ_FRAC 16
+
 // The states each key of the keypad can be in.
 typedef enum
 {
@@ -67,6 +94,98 @@ typedef enum
     BPBOTH
 } CHIP8BP;
 
+// What the machine is doing between instructions.
+typedef enum
+{
+    STATE_RUNNING,
+    STATE_KEY_WAIT, // Fx0A (at PC) is waiting for a key to be released.
+    STATE_HALTED    // 0000 (at PC) halted the program until the next reset.
+} CHIP8STATE;
+
+// Why chip8_run returned.
+typedef enum
+{
+    RUN_BUDGET,   // Executed every instruction it was allowed to.
+    RUN_DISPLAY,  // The display changed (Dxyn, 00E0, scrolls, 00FE/00FF).
+    RUN_KEY_WAIT, // Fx0A is waiting for a key (the budget is used up).
+    RUN_EXIT,     // The program exited (00FD).
+    RUN_HALT,     // The program halted (0000, the budget is used up).
+    RUN_STORAGE,  // The user flags storage was accessed (Fx75/Fx85).
+    RUN_IDLE      // The program is polling the delay timer, see chip8_run.
+} CHIP8RUN;
+
+// The operations an instruction can decode to.
+typedef enum
+{
+    OP_NONE, // Not decoded yet (empty decode cache entry).
+    OP_NOP,  // Unknown or unimplemented instruction.
+    OP_HALT,
+    OP_CLS,
+    OP_RET,
+    OP_SCRR,
+    OP_SCRL,
+    OP_EXIT,
+    OP_LORES,
+    OP_HIRES,
+    OP_SCRD,
+    OP_SCRU,
+    OP_JP,
+    OP_CALL,
+    OP_SE_BYTE,
+    OP_SNE_BYTE,
+    OP_SE_REG,
+    OP_SAVE_RANGE,
+    OP_LOAD_RANGE,
+    OP_LD_BYTE,
+    OP_ADD_BYTE,
+    OP_LD_REG,
+    OP_OR,
+    OP_AND,
+    OP_XOR,
+    OP_ADD_REG,
+    OP_SUB,
+    OP_SHR,
+    OP_SUBN,
+    OP_SHL,
+    OP_SNE_REG,
+    OP_LD_I,
+    OP_JP_V0,
+    OP_RND,
+    OP_DRW,
+    OP_SKP,
+    OP_SKNP,
+    OP_LD_I_LONG,
+    OP_PLANE,
+    OP_AUDIO,
+    OP_LD_VX_DT,
+    OP_LD_VX_K,
+    OP_LD_DT,
+    OP_LD_ST,
+    OP_ADD_I,
+    OP_LD_F,
+    OP_LD_HF,
+    OP_LD_B,
+    OP_PITCH,
+    OP_LD_MEM_VX,
+    OP_LD_VX_MEM,
+    OP_SAVE_FLAGS,
+    OP_LOAD_FLAGS,
+    NUM_OPS
+} CHIP8OP;
+
+// A decoded instruction along with its pre-extracted operands.
+typedef struct
+{
+    // The operation to perform (a CHIP8OP).
+    uint8_t op;
+
+    // The nibbles and low byte of the instruction (see chip8_execute).
+    uint8_t x, y, n, kk;
+
+    // The last 12 bits of the instruction.
+    uint16_t nnn;
+} CHIP8INSTR;
+
 typedef struct CHIP8
 {
     // Represents random-access memory.
@@ -84,11 +203,30 @@ typedef struct CHIP8
     // 8-bit register which controls audio pitch (XO-CHIP Only).
     uint8_t pitch;
 
-    // A monochrome display. A pixel can be either only on or off, no color.
-    bool display[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+    /* The audio pattern buffer at AUDIO_BUF_ADDR expanded to one entry per
+    bit, in the order they play: 1 where the wave is high, 0 where it's low.
+    Kept up to date by chip8_set_audio_pattern. */
+    uint8_t audio_pattern[AUDIO_PATTERN_BITS];
+
+    /* A monochrome display. A pixel can be either only on or off, no color.
+    Each row is packed one bit per pixel (see DISPLAY_PIXEL). */
+    uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS];
 
     // A second display for XO-CHIP support.
-    bool display2[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+    uint64_t display2[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS];
+
+    /* While lores_native is set, lores sprites are drawn at native resolution
+    into lores/lores2 (one word per row, same bit order as the display) and
+    only upscaled into display/display2 by chip8_sync_display. Bit y of
+    lores_dirty marks lores row y as not upscaled yet. */
+    bool lores_native;
+    uint32_t lores_dirty;
+    uint64_t lores[LORES_HEIGHT];
+    uint64_t lores2[LORES_HEIGHT];
+
+    /* Rows of either display changed since the frontend last cleared them,
+    bit y for row y. */
+    uint64_t dirty_rows;
 
     // Represents the bitmask of both displays.
     CHIP8BP bitplane;
@@ -103,14 +241,29 @@ typedef struct CHIP8
     unsigned long cpu_freq;
     unsigned long timer_freq;
     unsigned long refresh_freq;
-    long timer_max_cum;
-    long cpu_max_cum;
-    long cpu_cum;
-    long sound_cum;
-    long delay_cum;
-    long refresh_max_cum;
-    long refresh_cum;
-    long total_cycle_time;
+
+    /* total_cycle_time is the time of the last cycle in units of 1 /
+    time_base seconds (see chip8_set_cycle_time). The accumulators count time
+    in those units multiplied by the frequency they track, so a period of any
+    frequency is exactly time_base units and no rate is rounded. */
+    unsigned long time_base;
+    uint64_t total_cycle_time;
+    uint64_t cpu_cum;
+    uint64_t sound_cum;
+    uint64_t delay_cum;
+    uint64_t refresh_cum;
+
+    /* Instructions chip8_run charged to its budget without executing them
+    because the program was polling the delay timer (see RUN_IDLE). */
+    unsigned long idle_instrs;
+
+    /* With deterministic timing the timers and the screen refresh advance
+    with the number of instructions executed instead of with host time: they
+    tick every cpu_freq / timer_freq (or refresh_freq) instructions. The
+    counters hold the fractions carried over, in 1/cpu_freq units. */
+    bool deterministic;
+    uint64_t timer_instr_cum;
+    uint64_t refresh_instr_cum;
 
 #ifndef __LIBRETRO__
 #ifdef WIN32
@@ -145,8 +298,13 @@ typedef struct CHIP8
         -7: Collision Enumeration
         -8: Collision with Bottom of Screen
         -9: Disable undefined VF after logical OR, AND, XOR (VF is set to 0 with this disabled)
+    Bit n (QUIRK(n)) is set when quirk n is enabled. Change it through
+    chip8_set_quirks or chip8_set_quirk so the executor follows.
     */
-    bool quirks[NUM_QUIRKS];
+    uint16_t quirks;
+
+    // Executor specialized for the quirks (chosen by chip8_set_quirks).
+    uint8_t quirk_profile;
 
     // Used to signal to main to update the display.
     bool display_updated;
@@ -159,6 +317,12 @@ typedef struct CHIP8
 
     // Used to toggle between HI-RES and standard LO-RES modes.
     bool hires;
+
+    /* Whether the machine is running, waiting or halted. While it waits for
+    a key or is halted chip8_run doesn't dispatch anything, so frontends only
+    need to handle timers (and can sleep until a key is released or the
+    machine is reset). */
+    CHIP8STATE state;
 } CHIP8;
 
 // Set some things to useful default values.
@@ -172,6 +336,13 @@ void chip8_reset(CHIP8 *chip8);
 // Soft reset the machine (keep ROM and fonts loaded).
 void chip8_soft_reset(CHIP8 *chip8);
 
+/* Sets the quirks mask and picks the executor specialized for it (if any of
+the common profiles matches) so quirks need no checks while executing. */
+void chip8_set_quirks(CHIP8 *chip8, uint16_t quirks);
+
+// Enables or disables a single quirk.
+void chip8_set_quirk(CHIP8 *chip8, int quirk, bool enabled);
+
 // Sets the CPU frequency of the machine.
 void chip8_set_cpu_freq(CHIP8 *chip8, unsigned long cpu_freq);
 
@@ -181,6 +352,10 @@ void chip8_set_timer_freq(CHIP8 *chip8, unsigned long timer_freq);
 // Sets the refresh frequency of the machine.
 void chip8_set_refresh_freq(CHIP8 *chip8, unsigned long refresh_freq);
 
+/* Selects deterministic timing (see the deterministic field), restarting its
+counters. */
+void chip8_set_deterministic(CHIP8 *chip8, bool deterministic);
+
 // Load hexadecimal font into memory.
 void chip8_load_font(CHIP8 *chip8);
 
@@ -198,12 +373,63 @@ bool chip8_cycle(CHIP8 *chip8);
 // Fetches, decodes, and executes the next instruction.
 void chip8_execute(CHIP8 *chip8);
 
+/* Executes up to max_instructions instructions back to back without handling
+timers, returning early right after an instruction the frontend may want to
+react to (see CHIP8RUN). The number of instructions executed is stored in
+executed (if not NULL). Keys released since the last call are seen by the
+first instruction only. While the machine waits for a key (STATE_KEY_WAIT)
+or is halted (STATE_HALTED) no instruction runs and the whole budget is
+counted as executed. ROMs translated by jaxe-aot run their translated
+blocks, and on x86-64 other hot code runs through the dynamic recompiler.
+A loop polling the delay timer (see chip8_is_idle_loop) can't end before the
+timers are next handled, so its remaining iterations are counted as executed
+(and added to idle_instrs) without running them, and RUN_IDLE is returned. */
+CHIP8RUN chip8_run(CHIP8 *chip8, uint32_t max_instructions, uint32_t *executed);
+
+/* Executes up to max_instructions instructions back to back without handling
+timers, stopping early if the program exits. Returns the number of instructions
+executed. */
+uint32_t chip8_execute_instrs(CHIP8 *chip8, uint32_t max_instructions);
+
+/* Executes up to max_instructions instructions with deterministic timing:
+like chip8_execute_instrs, but DT, ST, beep and display_updated advance at
+exact instruction counts in between. Every run of the same ROM with the same
+input therefore behaves the same, whatever the speed of the host. Needs a
+CPU frequency; without one it doesn't touch the timers. Returns the number
+of instructions executed. */
+uint32_t chip8_run_deterministic(CHIP8 *chip8, uint32_t max_instructions);
+
+/* Instructions left until the next event of deterministic timing: a timer
+tick or a screen refresh (UINT32_MAX without a CPU frequency). Running at
+most that many with chip8_run_deterministic runs them as a single batch and
+fires the event, if it is reached, after the last of them. */
+uint32_t chip8_instructions_to_event(const CHIP8 *chip8);
+
+/* Whether the code at addr is a loop waiting for the delay timer:
+    addr:     LD Vx, DT  (Fx07)
+              SE Vx, kk  (3xkk) or SNE Vx, kk (4xkk)
+              JP addr    (1nnn)
+Nothing but a change of DT can make such a loop exit. */
+bool chip8_is_idle_loop(const uint8_t *RAM, uint16_t addr);
+
+// Decodes the instruction made up of bytes b1 and b2.
+void chip8_decode(CHIP8INSTR *instr, uint8_t b1, uint8_t b2);
+
+/* Discards any cached decoding of RAM in [addr, addr + len). Must be called
+after RAM is modified outside of the core (e.g. restoring a saved state). */
+void chip8_invalidate_code(CHIP8 *chip8, uint16_t addr, size_t len);
+
 // Decrements delay and sound timers at specified frequency.
 void chip8_handle_timers(CHIP8 *chip8);
 
 // Updates the total cycle time since last call.
 void chip8_update_elapsed_time(CHIP8 *chip8);
 
+/* Sets the time of the cycle chip8_handle_timers accounts for to cycle_time
+units of 1 / time_base seconds. Changing the unit rescales the accumulators so
+no partial period is lost. time_base must not be 0. */
+void chip8_set_cycle_time(CHIP8 *chip8, uint64_t cycle_time, unsigned long time_base);
+
 // Clears the keypad by setting all keys to up.
 void chip8_reset_keypad(CHIP8 *chip8);
 
@@ -213,6 +439,29 @@ void chip8_reset_released_keys(CHIP8 *chip8);
 // Clears the display by setting all pixels to off.
 void chip8_reset_display(CHIP8 *chip8, CHIP8BP bitplane);
 
+// Whether pixel (x, y) is on in the given bitplane (either plane for BPBOTH).
+bool chip8_get_pixel(const CHIP8 *chip8, CHIP8BP bitplane, int x, int y);
+
+// Turns pixel (x, y) on or off in the given bitplane(s).
+void chip8_set_pixel(CHIP8 *chip8, CHIP8BP bitplane, int x, int y, bool on);
+
+/* Upscales anything drawn at native lores resolution into display and
+display2. Frontends call it before reading them directly. */
+void chip8_sync_display(CHIP8 *chip8);
+
+// Switches between lores and hires mode (without clearing the display).
+void chip8_set_hires(CHIP8 *chip8, bool hires);
+
+/* Returns the rows changed since the last chip8_clear_dirty_rows, bit y
+for row y. Frontends use it to redraw only what changed. */
+uint64_t chip8_get_dirty_rows(const CHIP8 *chip8);
+
+// Forgets about changed rows once the frontend has presented them.
+void chip8_clear_dirty_rows(CHIP8 *chip8);
+
+// Marks the whole display as changed, e.g. when the frontend's colors change.
+void chip8_mark_display_dirty(CHIP8 *chip8);
+
 // Clears the RAM.
 void chip8_reset_RAM(CHIP8 *chip8);
 
@@ -222,6 +471,9 @@ void chip8_reset_registers(CHIP8 *chip8);
 // Reset audio buffer to default sound.
 void chip8_reset_audio(CHIP8 *chip8);
 
+// Stores the AUDIO_BUF_SIZE bytes at pattern in the audio pattern buffer.
+void chip8_set_audio_pattern(CHIP8 *chip8, const uint8_t *pattern);
+
 // Loads an instruction into memory.
 void chip8_load_instr(CHIP8 *chip8, uint16_t instr);
 
@@ -250,4 +502,8 @@ void chip8_skip_instr(CHIP8 *chip8);
 4000 * 2^((pitch - 64) / 48) */
 double chip8_get_sound_freq(CHIP8 *chip8);
 
+/* Returns the same frequency in fixed point with SOUND_FREQ_FRAC fractional
+bits, looked up without any floating point. */
+uint32_t chip8_get_sound_freq_fixed(const CHIP8 *chip8);
+
 #endif
@@ -2,14 +2,13 @@ LOCAL_PATH := $(call my-dir)
 
 CORE_DIR    := $(LOCAL_PATH)/..
 SOURCE_DIR  := $(CORE_DIR)/src
-INCFLAGS    := -I$(SOURCE_DIR)/deps/libretro-common/include -I$(SOURCE_DIR)/../include
 INCLUDES    :=
 SOURCES_C   :=
 SOURCES_CXX :=
 
 include $(CORE_DIR)/Makefile.common
 
-COREFLAGS := -DANDROID -D__LIBRETRO__ -DHAVE_STRINGS_H -DRIGHTSHIFT_IS_SAR $(INCFLAGS)
+COREFLAGS := -DANDROID -D__LIBRETRO__ -DHAVE_STRINGS_H -DRIGHTSHIFT_IS_SAR $(COREDEFINES) $(INCLUDES)
 GIT_VERSION := " $(shell git rev-parse --short HEAD || echo unknown)"
 ifneq ($(GIT_VERSION)," unknown")
   COREFLAGS += -DGIT_VERSION=\"$(GIT_VERSION)\"
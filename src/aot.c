@@ -0,0 +1,457 @@
+/* jaxe-aot: Translates ROMs ahead of time into a C unit to link into the
+emulator (see chip8_aot.h).
+
+Usage: jaxe-aot [-s pc_start_addr] -o output.c rom...
+
+Each ROM is walked statically from pc_start_addr, following jumps (1nnn),
+calls (2nnn), returns to the instruction after a call and both outcomes of
+every skip. Every basic block found becomes one C function built from the
+same instruction bodies the interpreter uses (chip8_ops.h). Code only
+reachable through computed jumps (Bnnn) or written at runtime is left to
+the interpreter, as are the instructions chip8_run reports (drawing, Fx0A,
+HALT, ...). The interpreter also takes over whenever RAM under a translated
+block no longer matches the ROM. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "chip8_aot.h"
+
+// A ROM being translated.
+typedef struct
+{
+    const char *path;
+    uint16_t pc_start_addr;
+    uint8_t RAM[MAX_RAM];
+    size_t size;
+
+    // Addresses reached by the walk, and those starting a basic block.
+    bool reached[MAX_RAM];
+    bool leader[MAX_RAM];
+} AOTROM;
+
+// The names of the CHIP8OP values, for the generated code.
+static const char *const op_names[NUM_OPS] = {
+#define CHIP8_OP(name, ...) [OP_##name] = "OP_" #name,
+#include "chip8_ops.h"
+#undef CHIP8_OP
+};
+
+// Returns the size of the instruction at addr (F000 nnnn is 4 bytes).
+static int aot_instr_size(const AOTROM *rom, uint32_t addr)
+{
+    return (rom->RAM[addr] == 0xF0 && rom->RAM[addr + 1] == 0x00) ? 4 : 2;
+}
+
+// Whether the block ends after an instruction.
+static bool aot_ends_block(uint8_t op)
+{
+    switch (op)
+    {
+    // Change the flow of execution.
+    case OP_RET:
+    case OP_JP:
+    case OP_CALL:
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+    case OP_SE_REG:
+    case OP_SNE_REG:
+    case OP_JP_V0:
+    case OP_SKP:
+    case OP_SKNP:
+    // Write RAM (and so may modify the code that follows).
+    case OP_SAVE_RANGE:
+    case OP_AUDIO:
+    case OP_LD_B:
+    case OP_LD_MEM_VX:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/* Whether the instruction at addr is left to the interpreter, ending the block
+before it. These are the instructions chip8_run reports to the frontend and
+the heads of idle loops, which chip8_run skips. */
+static bool aot_interpreted(const AOTROM *rom, uint32_t addr, uint8_t op)
+{
+    if (chip8_is_idle_loop(rom->RAM, addr))
+    {
+        return true;
+    }
+
+    switch (op)
+    {
+    case OP_HALT:
+    case OP_CLS:
+    case OP_SCRR:
+    case OP_SCRL:
+    case OP_EXIT:
+    case OP_LORES:
+    case OP_HIRES:
+    case OP_SCRD:
+    case OP_SCRU:
+    case OP_DRW:
+    case OP_LD_VX_K:
+    case OP_SAVE_FLAGS:
+    case OP_LOAD_FLAGS:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Whether an instruction reads (or adjusts) PC and so needs it up to date.
+static bool aot_needs_pc(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CALL:
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+    case OP_SE_REG:
+    case OP_SNE_REG:
+    case OP_SKP:
+    case OP_SKNP:
+    case OP_LD_I_LONG:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Whether an instruction always sets PC itself.
+static bool aot_sets_pc(uint8_t op)
+{
+    return op == OP_JP || op == OP_RET || op == OP_JP_V0;
+}
+
+// Whether addr holds a whole instruction of the ROM that can be translated.
+static bool aot_in_rom(const AOTROM *rom, uint32_t addr)
+{
+    uint32_t end = rom->pc_start_addr + rom->size;
+    if (end > MAX_RAM - 1)
+    {
+        end = MAX_RAM - 1;
+    }
+
+    return addr >= rom->pc_start_addr && addr + aot_instr_size(rom, addr) <= end;
+}
+
+static void aot_add_leader(AOTROM *rom, uint32_t *work, int *num_work, uint32_t addr)
+{
+    addr &= 0xFFFF;
+    if (!rom->leader[addr])
+    {
+        rom->leader[addr] = true;
+        work[(*num_work)++] = addr;
+    }
+}
+
+// Finds every instruction reachable from pc_start_addr and the block leaders.
+static void aot_walk(AOTROM *rom)
+{
+    static uint32_t work[MAX_RAM];
+    int num_work = 0;
+
+    aot_add_leader(rom, work, &num_work, rom->pc_start_addr);
+
+    while (num_work > 0)
+    {
+        uint32_t pc = work[--num_work];
+
+        while (aot_in_rom(rom, pc) && !rom->reached[pc])
+        {
+            rom->reached[pc] = true;
+
+            CHIP8INSTR in;
+            chip8_decode(&in, rom->RAM[pc], rom->RAM[pc + 1]);
+            uint32_t next = pc + aot_instr_size(rom, pc);
+
+            switch (in.op)
+            {
+            case OP_JP:
+                aot_add_leader(rom, work, &num_work, in.nnn);
+                break;
+
+            case OP_CALL:
+                aot_add_leader(rom, work, &num_work, in.nnn);
+                aot_add_leader(rom, work, &num_work, next);
+                break;
+
+            case OP_SE_BYTE:
+            case OP_SNE_BYTE:
+            case OP_SE_REG:
+            case OP_SNE_REG:
+            case OP_SKP:
+            case OP_SKNP:
+                aot_add_leader(rom, work, &num_work, next);
+                aot_add_leader(rom, work, &num_work, next + aot_instr_size(rom, next));
+                break;
+
+            default:
+                // Returns, Bnnn, HALT and EXIT lead nowhere static.
+                if ((aot_ends_block(in.op) || aot_interpreted(rom, pc, in.op)) &&
+                    in.op != OP_HALT && in.op != OP_RET &&
+                    in.op != OP_EXIT && in.op != OP_JP_V0)
+                {
+                    aot_add_leader(rom, work, &num_work, next);
+                }
+                break;
+            }
+
+            if (aot_ends_block(in.op) || aot_interpreted(rom, pc, in.op))
+            {
+                break;
+            }
+
+            pc = next;
+        }
+    }
+}
+
+// Writes a C string literal.
+static void aot_write_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fputc('\\', out);
+        }
+
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// Writes the translated blocks of one ROM and its CHIP8AOT.
+static void aot_write_rom(FILE *out, AOTROM *rom, int r)
+{
+    fprintf(out, "/* ROM %d: ", r);
+    for (const char *s = rom->path; *s; s++)
+    {
+        // Keep the path from closing the comment.
+        fputc((*s == '*') ? '_' : *s, out);
+    }
+    fprintf(out, " */\n");
+
+    fprintf(out, "static const uint8_t rom%d[] = {", r);
+    for (size_t i = 0; i < rom->size; i++)
+    {
+        fprintf(out, "%s0x%02X,", (i % 12) ? " " : "\n    ",
+                rom->RAM[rom->pc_start_addr + i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    static CHIP8AOTBLOCK blocks[MAX_RAM];
+    size_t num_blocks = 0;
+
+    // Every leader gets a block, Octo often places code at odd addresses.
+    for (uint32_t start = rom->pc_start_addr; start < MAX_RAM; start++)
+    {
+        if (!rom->leader[start] || !rom->reached[start])
+        {
+            continue;
+        }
+
+        CHIP8INSTR in;
+        chip8_decode(&in, rom->RAM[start], rom->RAM[start + 1]);
+        if (aot_interpreted(rom, start, in.op))
+        {
+            continue;
+        }
+
+        fprintf(out, "static void rom%d_%04X(CHIP8 *chip8)\n{\n", r, start);
+
+        uint32_t pc = start;
+        int len = 0;
+        uint8_t op = OP_NONE;
+        while (len < CHIP8_AOT_MAX_BLOCK_INSTRS && aot_in_rom(rom, pc) &&
+               (pc == start || !rom->leader[pc]))
+        {
+            chip8_decode(&in, rom->RAM[pc], rom->RAM[pc + 1]);
+            if (aot_interpreted(rom, pc, in.op))
+            {
+                break;
+            }
+            op = in.op;
+
+            // Like the interpreter, PC is already past the instruction.
+            if (aot_needs_pc(op))
+            {
+                fprintf(out, "    chip8->PC = 0x%04X;\n", pc + 2);
+            }
+
+            fprintf(out, "    {\n");
+            fprintf(out, "        // %04X: %02X%02X\n", pc, rom->RAM[pc], rom->RAM[pc + 1]);
+            fprintf(out, "        const CHIP8INSTR in = {%s, 0x%X, 0x%X, 0x%X, 0x%02X, 0x%03X};\n",
+                    op_names[op], in.x, in.y, in.n, in.kk, in.nnn);
+            fprintf(out, "        op_%s(chip8, in);\n", op_names[op] + 3);
+            fprintf(out, "    }\n");
+
+            pc += aot_instr_size(rom, pc);
+            len++;
+
+            if (aot_ends_block(op))
+            {
+                break;
+            }
+        }
+
+        if (!aot_needs_pc(op) && !aot_sets_pc(op))
+        {
+            fprintf(out, "    chip8->PC = 0x%04X;\n", pc);
+        }
+        fprintf(out, "}\n\n");
+
+        blocks[num_blocks].start = start;
+        blocks[num_blocks].end = pc;
+        blocks[num_blocks].len = len;
+        num_blocks++;
+    }
+
+    fprintf(out, "static const CHIP8AOTBLOCK rom%d_blocks[] = {\n", r);
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        fprintf(out, "    {0x%04X, 0x%04X, %d, rom%d_%04X},\n", blocks[i].start,
+                blocks[i].end, blocks[i].len, r, blocks[i].start);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const CHIP8AOT rom%d_program = {\n    ", r);
+    aot_write_string(out, rom->path);
+    fprintf(out, ",\n    0x%03X,\n    rom%d,\n    sizeof(rom%d),\n", rom->pc_start_addr, r, r);
+    fprintf(out, "    rom%d_blocks,\n    sizeof(rom%d_blocks) / sizeof(rom%d_blocks[0])};\n\n", r, r, r);
+
+    printf("%s: %lu blocks\n", rom->path, (unsigned long)num_blocks);
+}
+
+static void aot_usage(void)
+{
+    fprintf(stderr, "Usage: jaxe-aot [-s pc_start_addr] -o output.c rom...\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t pc_start_addr = PC_START_ADDR_DEFAULT;
+    const char *out_path = NULL;
+    int first_rom = argc;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            pc_start_addr = (uint16_t)strtol(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            out_path = argv[++i];
+        }
+        else
+        {
+            first_rom = i;
+            break;
+        }
+    }
+
+    if (out_path == NULL || first_rom >= argc)
+    {
+        aot_usage();
+        return 1;
+    }
+
+    /* Write to a temporary file renamed over out_path once complete, so a
+    failure never leaves a unit without the program table behind. */
+    char *tmp_path = malloc(strlen(out_path) + sizeof(".tmp"));
+    if (!tmp_path)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    sprintf(tmp_path, "%s.tmp", out_path);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out)
+    {
+        fprintf(stderr, "Unable to open output file %s\n", tmp_path);
+        free(tmp_path);
+        return 1;
+    }
+
+    fprintf(out, "/* Generated by jaxe-aot. Do not edit. */\n\n");
+    fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include \"chip8_aot.h\"\n\n");
+    fprintf(out, "// The interpreter's instruction bodies, one inline function each.\n");
+    fprintf(out, "#define CHIP8_QUIRK(n) ((chip8->quirks & QUIRK(n)) != 0)\n");
+    fprintf(out, "#define CHIP8_DRAW chip8_draw\n");
+    fprintf(out, "#define CHIP8_OP(name, ...)                                  \\\n");
+    fprintf(out, "    CHIP8_AOT_INLINE void op_##name(CHIP8 *chip8, CHIP8INSTR in) \\\n");
+    fprintf(out, "    {                                                    \\\n");
+    fprintf(out, "        (void)chip8;                                     \\\n");
+    fprintf(out, "        (void)in;                                        \\\n");
+    fprintf(out, "        __VA_ARGS__                                      \\\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "#include \"chip8_ops.h\"\n#undef CHIP8_OP\n\n");
+
+    static AOTROM rom;
+    int num_roms = 0;
+    for (int i = first_rom; i < argc; i++)
+    {
+        memset(&rom, 0, sizeof(rom));
+        rom.path = argv[i];
+        rom.pc_start_addr = pc_start_addr;
+
+        FILE *f = fopen(argv[i], "rb");
+        if (!f)
+        {
+            fprintf(stderr, "Unable to open ROM file %s\n", argv[i]);
+            fclose(out);
+            remove(tmp_path);
+            free(tmp_path);
+            return 1;
+        }
+
+        rom.size = fread(rom.RAM + pc_start_addr, 1, MAX_RAM - pc_start_addr, f);
+        fclose(f);
+
+        aot_walk(&rom);
+        aot_write_rom(out, &rom, num_roms++);
+    }
+
+    fprintf(out, "const CHIP8AOT *const chip8_aot_programs[] = {\n");
+    for (int r = 0; r < num_roms; r++)
+    {
+        fprintf(out, "    &rom%d_program,\n", r);
+    }
+    fprintf(out, "    NULL};\n");
+
+    bool failed = ferror(out) != 0;
+    if (fclose(out) != 0 || failed)
+    {
+        fprintf(stderr, "Unable to write output file %s\n", tmp_path);
+        failed = true;
+    }
+    else if (rename(tmp_path, out_path) != 0)
+    {
+        // Windows doesn't rename over an existing file.
+        remove(out_path);
+        if (rename(tmp_path, out_path) != 0)
+        {
+            fprintf(stderr, "Unable to write output file %s\n", out_path);
+            failed = true;
+        }
+    }
+
+    if (failed)
+    {
+        remove(tmp_path);
+    }
+
+    free(tmp_path);
+    return failed ? 1 : 0;
+}
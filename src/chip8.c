@@ -2,8 +2,277 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <math.h>
 #include "chip8.h"
+#include "chip8_dynarec.h"
+#include "chip8_aot.h"
+
+/* Execution engine, selected at build time:
+    -default: switch over the decoded operation.
+    -CHIP8_DISPATCH_TABLE: call through a table of handler functions.
+    -CHIP8_DISPATCH_GOTO: jump through a table of labels (GCC/Clang only,
+     falls back to CHIP8_DISPATCH_TABLE elsewhere).
+Both table engines also decode through a 64K-entry opcode table instead of
+the nested opcode switch. */
+#if defined(CHIP8_DISPATCH_GOTO) && !defined(__GNUC__)
+#undef CHIP8_DISPATCH_GOTO
+#define CHIP8_DISPATCH_TABLE
+#endif
+
+#if defined(CHIP8_DISPATCH_GOTO) || defined(CHIP8_DISPATCH_TABLE)
+#define CHIP8_OPCODE_TABLE
+#endif
+
+#ifdef CHIP8_OPCODE_TABLE
+// The operation of every possible instruction, indexed by the full opcode.
+static uint8_t opcode_table[MAX_RAM];
+static bool opcode_table_ready = false;
+#endif
+
+#ifndef CHIP8_NO_DECODE_CACHE
+/* Decoded-instruction cache with one entry per even address. Entries are
+decoded on first execution and discarded by chip8_invalidate_code whenever the
+bytes they were decoded from are written. The cache belongs to whichever
+machine last executed an instruction. */
+static CHIP8INSTR decode_cache[MAX_RAM / 2];
+static CHIP8 *decode_cache_owner = NULL;
+#endif
+
+// Fetches and decodes the instruction at PC, using the cache if possible.
+static void chip8_fetch(CHIP8 *chip8, CHIP8INSTR *instr)
+{
+#ifndef CHIP8_NO_DECODE_CACHE
+    // Odd addresses are rare enough (Bnnn only) to always decode directly.
+    if (!(chip8->PC & 1))
+    {
+        if (decode_cache_owner != chip8)
+        {
+            memset(decode_cache, 0, sizeof(decode_cache));
+            decode_cache_owner = chip8;
+        }
+
+        CHIP8INSTR *entry = &decode_cache[chip8->PC >> 1];
+        if (entry->op == OP_NONE)
+        {
+            chip8_decode(entry, chip8->RAM[chip8->PC], chip8->RAM[chip8->PC + 1]);
+        }
+
+        /* Copy the entry since the instruction may overwrite (and thus
+        invalidate) itself. */
+        *instr = *entry;
+        return;
+    }
+#endif
+
+    chip8_decode(instr, chip8->RAM[chip8->PC], chip8->RAM[chip8->PC + 1]);
+}
+
+// Each byte with every bit doubled, for drawing lores sprites.
+static const uint16_t lores_expand[256] = {
+    0x0000, 0x0003, 0x000C, 0x000F, 0x0030, 0x0033, 0x003C, 0x003F,
+    0x00C0, 0x00C3, 0x00CC, 0x00CF, 0x00F0, 0x00F3, 0x00FC, 0x00FF,
+    0x0300, 0x0303, 0x030C, 0x030F, 0x0330, 0x0333, 0x033C, 0x033F,
+    0x03C0, 0x03C3, 0x03CC, 0x03CF, 0x03F0, 0x03F3, 0x03FC, 0x03FF,
+    0x0C00, 0x0C03, 0x0C0C, 0x0C0F, 0x0C30, 0x0C33, 0x0C3C, 0x0C3F,
+    0x0CC0, 0x0CC3, 0x0CCC, 0x0CCF, 0x0CF0, 0x0CF3, 0x0CFC, 0x0CFF,
+    0x0F00, 0x0F03, 0x0F0C, 0x0F0F, 0x0F30, 0x0F33, 0x0F3C, 0x0F3F,
+    0x0FC0, 0x0FC3, 0x0FCC, 0x0FCF, 0x0FF0, 0x0FF3, 0x0FFC, 0x0FFF,
+    0x3000, 0x3003, 0x300C, 0x300F, 0x3030, 0x3033, 0x303C, 0x303F,
+    0x30C0, 0x30C3, 0x30CC, 0x30CF, 0x30F0, 0x30F3, 0x30FC, 0x30FF,
+    0x3300, 0x3303, 0x330C, 0x330F, 0x3330, 0x3333, 0x333C, 0x333F,
+    0x33C0, 0x33C3, 0x33CC, 0x33CF, 0x33F0, 0x33F3, 0x33FC, 0x33FF,
+    0x3C00, 0x3C03, 0x3C0C, 0x3C0F, 0x3C30, 0x3C33, 0x3C3C, 0x3C3F,
+    0x3CC0, 0x3CC3, 0x3CCC, 0x3CCF, 0x3CF0, 0x3CF3, 0x3CFC, 0x3CFF,
+    0x3F00, 0x3F03, 0x3F0C, 0x3F0F, 0x3F30, 0x3F33, 0x3F3C, 0x3F3F,
+    0x3FC0, 0x3FC3, 0x3FCC, 0x3FCF, 0x3FF0, 0x3FF3, 0x3FFC, 0x3FFF,
+    0xC000, 0xC003, 0xC00C, 0xC00F, 0xC030, 0xC033, 0xC03C, 0xC03F,
+    0xC0C0, 0xC0C3, 0xC0CC, 0xC0CF, 0xC0F0, 0xC0F3, 0xC0FC, 0xC0FF,
+    0xC300, 0xC303, 0xC30C, 0xC30F, 0xC330, 0xC333, 0xC33C, 0xC33F,
+    0xC3C0, 0xC3C3, 0xC3CC, 0xC3CF, 0xC3F0, 0xC3F3, 0xC3FC, 0xC3FF,
+    0xCC00, 0xCC03, 0xCC0C, 0xCC0F, 0xCC30, 0xCC33, 0xCC3C, 0xCC3F,
+    0xCCC0, 0xCCC3, 0xCCCC, 0xCCCF, 0xCCF0, 0xCCF3, 0xCCFC, 0xCCFF,
+    0xCF00, 0xCF03, 0xCF0C, 0xCF0F, 0xCF30, 0xCF33, 0xCF3C, 0xCF3F,
+    0xCFC0, 0xCFC3, 0xCFCC, 0xCFCF, 0xCFF0, 0xCFF3, 0xCFFC, 0xCFFF,
+    0xF000, 0xF003, 0xF00C, 0xF00F, 0xF030, 0xF033, 0xF03C, 0xF03F,
+    0xF0C0, 0xF0C3, 0xF0CC, 0xF0CF, 0xF0F0, 0xF0F3, 0xF0FC, 0xF0FF,
+    0xF300, 0xF303, 0xF30C, 0xF30F, 0xF330, 0xF333, 0xF33C, 0xF33F,
+    0xF3C0, 0xF3C3, 0xF3CC, 0xF3CF, 0xF3F0, 0xF3F3, 0xF3FC, 0xF3FF,
+    0xFC00, 0xFC03, 0xFC0C, 0xFC0F, 0xFC30, 0xFC33, 0xFC3C, 0xFC3F,
+    0xFCC0, 0xFCC3, 0xFCCC, 0xFCCF, 0xFCF0, 0xFCF3, 0xFCFC, 0xFCFF,
+    0xFF00, 0xFF03, 0xFF0C, 0xFF0F, 0xFF30, 0xFF33, 0xFF3C, 0xFF3F,
+    0xFFC0, 0xFFC3, 0xFFCC, 0xFFCF, 0xFFF0, 0xFFF3, 0xFFFC, 0xFFFF,
+};
+
+/* Builds the 128-pixel mask of one sprite row (one byte, or two if wide)
+drawn at display column col (< DISPLAY_WIDTH). Pixels past the right edge
+wrap around to the left if wrap is set or are clipped otherwise. */
+static void chip8_sprite_mask(const uint8_t *data, bool wide, int scale, unsigned col,
+                              bool wrap, uint64_t mask[DISPLAY_ROW_WORDS])
+{
+    uint32_t bits = wide ? ((uint32_t)data[0] << 8) | data[1] : data[0];
+    int width = wide ? 16 : 8;
+
+    if (scale == 2)
+    {
+        bits = wide ? ((uint32_t)lores_expand[bits >> 8] << 16) | lores_expand[bits & 0xFF]
+                    : lores_expand[bits];
+        width *= 2;
+    }
+
+    // Left-align the row, then shift it to its column.
+    uint64_t row = (uint64_t)bits << (64 - width);
+    unsigned shift = col & 63;
+    uint64_t spill = shift ? row << (64 - shift) : 0;
+
+    if (col < 64)
+    {
+        mask[0] = row >> shift;
+        mask[1] = spill;
+    }
+    else
+    {
+        mask[0] = wrap ? spill : 0;
+        mask[1] = row >> shift;
+    }
+}
+
+// Builds the mask of one sprite row drawn at lores column col (< LORES_WIDTH).
+static uint64_t chip8_lores_mask(const uint8_t *data, bool wide, unsigned col, bool wrap)
+{
+    uint64_t row = wide ? ((uint64_t)data[0] << 56) | ((uint64_t)data[1] << 48)
+                        : (uint64_t)data[0] << 56;
+
+    return (row >> col) | ((wrap && col) ? row << (64 - col) : 0);
+}
+
+// Doubles every bit of a lores half row, giving a display row word.
+static uint64_t chip8_upscale_word(uint32_t bits)
+{
+    return ((uint64_t)lores_expand[bits >> 24] << 48) |
+           ((uint64_t)lores_expand[(bits >> 16) & 0xFF] << 32) |
+           ((uint64_t)lores_expand[(bits >> 8) & 0xFF] << 16) |
+           lores_expand[bits & 0xFF];
+}
+
+/* Stops drawing at native lores resolution, e.g. when something needs
+display pixels that don't line up with lores pixels. */
+static void chip8_leave_lores(CHIP8 *chip8)
+{
+    chip8_sync_display(chip8);
+    chip8->lores_native = false;
+}
+
+/* Quirk profiles with an executor specialized at compile time. Any other
+combination of quirks runs the generic executor. */
+typedef enum
+{
+    QUIRK_PROFILE_GENERIC,
+    QUIRK_PROFILE_SCHIP,
+    QUIRK_PROFILE_LEGACY,
+    QUIRK_PROFILE_XOCHIP,
+    NUM_QUIRK_PROFILES
+} CHIP8QUIRKPROFILE;
+
+#define CHIP8_EXEC_SUFFIX generic
+#include "chip8_exec.h"
+
+#define CHIP8_EXEC_SUFFIX schip
+#define CHIP8_EXEC_QUIRKS QUIRKS_SCHIP
+#include "chip8_exec.h"
+
+#define CHIP8_EXEC_SUFFIX legacy
+#define CHIP8_EXEC_QUIRKS QUIRKS_LEGACY
+#include "chip8_exec.h"
+
+#define CHIP8_EXEC_SUFFIX xochip
+#define CHIP8_EXEC_QUIRKS QUIRKS_XOCHIP
+#include "chip8_exec.h"
+
+/* Sound frequency of each pitch, 4000 * 2^((pitch - 64) / 48) Hz, with
+SOUND_FREQ_FRAC fractional bits. */
+static const uint32_t chip8_pitch_freq[256] = {
+    104031915u, 105545094u, 107080283u, 108637802u, 110217975u, 111821132u,
+    113447608u, 115097742u, 116771877u, 118470363u, 120193554u, 121941809u,
+    123715494u, 125514977u, 127340635u, 129192847u, 131072000u, 132978486u,
+    134912703u, 136875053u, 138865947u, 140885798u, 142935030u, 145014067u,
+    147123346u, 149263304u, 151434389u, 153637053u, 155871755u, 158138962u,
+    160439146u, 162772787u, 165140372u, 167542394u, 169979354u, 172451761u,
+    174960129u, 177504983u, 180086852u, 182706276u, 185363800u, 188059979u,
+    190795374u, 193570557u, 196386105u, 199242607u, 202140657u, 205080861u,
+    208063831u, 211090189u, 214160566u, 217275603u, 220435950u, 223642265u,
+    226895216u, 230195483u, 233543754u, 236940726u, 240387108u, 243883619u,
+    247430988u, 251029954u, 254681269u, 258385694u, 262144000u, 265956972u,
+    269825406u, 273750106u, 277731893u, 281771597u, 285870059u, 290028135u,
+    294246691u, 298526608u, 302868777u, 307274105u, 311743510u, 316277924u,
+    320878292u, 325545574u, 330280744u, 335084788u, 339958708u, 344903521u,
+    349920259u, 355009966u, 360173705u, 365412552u, 370727600u, 376119957u,
+    381590748u, 387141113u, 392772210u, 398485214u, 404281315u, 410161722u,
+    416127661u, 422180378u, 428321133u, 434551207u, 440871900u, 447284529u,
+    453790432u, 460390966u, 467087507u, 473881451u, 480774216u, 487767238u,
+    494861976u, 502059909u, 509362538u, 516771387u, 524288000u, 531913945u,
+    539650811u, 547500213u, 555463787u, 563543194u, 571740118u, 580056270u,
+    588493382u, 597053216u, 605737555u, 614548210u, 623487020u, 632555847u,
+    641756584u, 651091149u, 660561487u, 670169575u, 679917416u, 689807043u,
+    699840517u, 710019932u, 720347410u, 730825104u, 741455200u, 752239914u,
+    763181496u, 774282226u, 785544421u, 796970427u, 808562629u, 820323443u,
+    832255323u, 844360755u, 856642265u, 869102414u, 881743800u, 894569058u,
+    907580865u, 920781933u, 934175014u, 947762903u, 961548432u, 975534476u,
+    989723951u, 1004119818u, 1018725077u, 1033542774u, 1048576000u, 1063827889u,
+    1079301622u, 1095000426u, 1110927574u, 1127086387u, 1143480236u, 1160112539u,
+    1176986765u, 1194106431u, 1211475109u, 1229096421u, 1246974040u, 1265111695u,
+    1283513168u, 1302182297u, 1321122975u, 1340339151u, 1359834833u, 1379614086u,
+    1399681035u, 1420039864u, 1440694820u, 1461650209u, 1482910400u, 1504479829u,
+    1526362992u, 1548564453u, 1571088841u, 1593940855u, 1617125258u, 1640646887u,
+    1664510645u, 1688721510u, 1713284530u, 1738204828u, 1763487599u, 1789138117u,
+    1815161730u, 1841563865u, 1868350029u, 1895525805u, 1923096863u, 1951068951u,
+    1979447903u, 2008239635u, 2037450153u, 2067085548u, 2097152000u, 2127655778u,
+    2158603244u, 2190000851u, 2221855147u, 2254172775u, 2286960473u, 2320225079u,
+    2353973530u, 2388212863u, 2422950219u, 2458192841u, 2493948080u, 2530223390u,
+    2567026336u, 2604364594u, 2642245950u, 2680678302u, 2719669666u, 2759228172u,
+    2799362070u, 2840079729u, 2881389640u, 2923300417u, 2965820801u, 3008959658u,
+    3052725984u, 3097128906u, 3142177683u, 3187881710u, 3234250517u, 3281293774u,
+    3329021291u, 3377443021u, 3426569061u, 3476409655u, 3526975198u, 3578276234u,
+    3630323460u, 3683127731u, 3736700057u, 3791051611u, 3846193726u, 3902137902u,
+    3958895805u, 4016479271u, 4074900307u, 4134171097u
+};
+
+// Quirks mask, executor and sprite routine of each profile.
+static const uint16_t chip8_profile_quirks[NUM_QUIRK_PROFILES] = {
+    [QUIRK_PROFILE_SCHIP] = QUIRKS_SCHIP,
+    [QUIRK_PROFILE_LEGACY] = QUIRKS_LEGACY,
+    [QUIRK_PROFILE_XOCHIP] = QUIRKS_XOCHIP,
+};
+
+static uint8_t (*const chip8_executors[NUM_QUIRK_PROFILES])(CHIP8 *chip8) = {
+    [QUIRK_PROFILE_GENERIC] = chip8_execute_generic,
+    [QUIRK_PROFILE_SCHIP] = chip8_execute_schip,
+    [QUIRK_PROFILE_LEGACY] = chip8_execute_legacy,
+    [QUIRK_PROFILE_XOCHIP] = chip8_execute_xochip,
+};
+
+static void (*const chip8_draws[NUM_QUIRK_PROFILES])(CHIP8 *chip8, uint8_t x, uint8_t y,
+                                                     uint8_t n, CHIP8BP bitplane) = {
+    [QUIRK_PROFILE_GENERIC] = chip8_draw_generic,
+    [QUIRK_PROFILE_SCHIP] = chip8_draw_schip,
+    [QUIRK_PROFILE_LEGACY] = chip8_draw_legacy,
+    [QUIRK_PROFILE_XOCHIP] = chip8_draw_xochip,
+};
+
+// What chip8_run reports after each operation (RUN_BUDGET for nothing).
+static const uint8_t chip8_run_events[NUM_OPS] = {
+    [OP_HALT] = RUN_HALT,
+    [OP_CLS] = RUN_DISPLAY,
+    [OP_SCRR] = RUN_DISPLAY,
+    [OP_SCRL] = RUN_DISPLAY,
+    [OP_EXIT] = RUN_EXIT,
+    [OP_LORES] = RUN_DISPLAY,
+    [OP_HIRES] = RUN_DISPLAY,
+    [OP_SCRD] = RUN_DISPLAY,
+    [OP_SCRU] = RUN_DISPLAY,
+    [OP_DRW] = RUN_DISPLAY,
+    [OP_LD_VX_K] = RUN_KEY_WAIT,
+    [OP_SAVE_FLAGS] = RUN_STORAGE,
+    [OP_LOAD_FLAGS] = RUN_STORAGE,
+};
 
 void chip8_init(CHIP8 *chip8, unsigned long cpu_freq, unsigned long timer_freq,
                 unsigned long refresh_freq, uint16_t pc_start_addr,
@@ -12,14 +281,24 @@ void chip8_init(CHIP8 *chip8, unsigned long cpu_freq, unsigned long timer_freq,
     // Seed for the RND instruction.
     srand(time(NULL));
 
+    uint16_t mask = 0;
     for (int i = 0; i < NUM_QUIRKS; i++)
     {
-        chip8->quirks[i] = quirks[i];
+        if (quirks[i])
+        {
+            mask |= QUIRK(i);
+        }
     }
+    chip8_set_quirks(chip8, mask);
 
-    chip8_set_cpu_freq(chip8, cpu_freq);
+    // Not chip8_set_cpu_freq, which rescales timers that aren't set up yet.
+    chip8->cpu_freq = cpu_freq;
     chip8_set_timer_freq(chip8, timer_freq);
     chip8_set_refresh_freq(chip8, refresh_freq);
+    chip8->deterministic = false;
+    chip8->time_base = ONE_SEC;
+    chip8->total_cycle_time = 0;
+    chip8->refresh_cum = 0;
 
     chip8->pc_start_addr = pc_start_addr;
     chip8->bitplane = BP1;
@@ -51,19 +330,24 @@ void chip8_reset(CHIP8 *chip8)
     chip8->cpu_cum = 0;
     chip8->sound_cum = 0;
     chip8->delay_cum = 0;
+    chip8->idle_instrs = 0;
+    chip8->timer_instr_cum = 0;
+    chip8->refresh_instr_cum = 0;
 
     chip8->display_updated = false;
     chip8->beep = false;
     chip8->exit = false;
     chip8->hires = false;
+    chip8->lores_native = false;
     chip8->bitplane = BP1;
+    chip8->state = STATE_RUNNING;
 
     chip8->ROM_path[0] = '\0';
     chip8->UF_path[0] = '\0';
     chip8->DMP_path[0] = '\0';
 
     // S-CHIP did not initialize RAM (does it matter though?)
-    if (!chip8->quirks[0])
+    if (!(chip8->quirks & QUIRK(0)))
     {
         chip8_reset_RAM(chip8);
     }
@@ -86,34 +370,54 @@ void chip8_soft_reset(CHIP8 *chip8)
 }
 #endif
 
-void chip8_set_cpu_freq(CHIP8 *chip8, unsigned long cpu_freq)
+void chip8_set_quirks(CHIP8 *chip8, uint16_t quirks)
 {
-    chip8->cpu_freq = cpu_freq;
+    chip8->quirks = quirks;
+    chip8->quirk_profile = QUIRK_PROFILE_GENERIC;
 
-    if (cpu_freq > 0)
+    for (int i = 0; i < NUM_QUIRK_PROFILES; i++)
     {
-        chip8->cpu_max_cum = ONE_SEC / chip8->cpu_freq;
+        if (i != QUIRK_PROFILE_GENERIC && chip8_profile_quirks[i] == quirks)
+        {
+            chip8->quirk_profile = i;
+            break;
+        }
     }
 }
 
-void chip8_set_timer_freq(CHIP8 *chip8, unsigned long timer_freq)
+void chip8_set_quirk(CHIP8 *chip8, int quirk, bool enabled)
 {
-    chip8->timer_freq = timer_freq;
+    chip8_set_quirks(chip8, enabled ? (chip8->quirks | QUIRK(quirk))
+                                    : (chip8->quirks & ~QUIRK(quirk)));
+}
 
-    if (timer_freq > 0)
+void chip8_set_cpu_freq(CHIP8 *chip8, unsigned long cpu_freq)
+{
+    // Keep the deterministic timers at the same point of their periods.
+    if (chip8->cpu_freq && cpu_freq)
     {
-        chip8->timer_max_cum = ONE_SEC / chip8->timer_freq;
+        chip8->timer_instr_cum = chip8->timer_instr_cum * cpu_freq / chip8->cpu_freq;
+        chip8->refresh_instr_cum = chip8->refresh_instr_cum * cpu_freq / chip8->cpu_freq;
     }
+
+    chip8->cpu_freq = cpu_freq;
+}
+
+void chip8_set_deterministic(CHIP8 *chip8, bool deterministic)
+{
+    chip8->deterministic = deterministic;
+    chip8->timer_instr_cum = 0;
+    chip8->refresh_instr_cum = 0;
+}
+
+void chip8_set_timer_freq(CHIP8 *chip8, unsigned long timer_freq)
+{
+    chip8->timer_freq = timer_freq;
 }
 
 void chip8_set_refresh_freq(CHIP8 *chip8, unsigned long refresh_freq)
 {
     chip8->refresh_freq = refresh_freq;
-
-    if (refresh_freq > 0)
-    {
-        chip8->refresh_max_cum = ONE_SEC / chip8->refresh_freq;
-    }
 }
 
 void chip8_load_font(CHIP8 *chip8)
@@ -166,6 +470,8 @@ void chip8_load_font(CHIP8 *chip8)
     {
         chip8->RAM[FONT_START_ADDR + i] = font_data[i];
     }
+
+    chip8_invalidate_code(chip8, FONT_START_ADDR, sizeof(font_data));
 }
 
 #ifndef __LIBRETRO__
@@ -180,6 +486,12 @@ bool chip8_load_rom(CHIP8 *chip8, char *filename)
 
         fclose(rom);
 
+        chip8_invalidate_code(chip8, chip8->pc_start_addr,
+                              MAX_RAM - chip8->pc_start_addr);
+#ifdef CHIP8_AOT
+        chip8_aot_load(chip8);
+#endif
+
         snprintf(chip8->ROM_path, sizeof(chip8->ROM_path) - 1, "%s", filename);
         snprintf(chip8->UF_path, sizeof(chip8->UF_path) - 1, "%s.uf", filename);
         snprintf(chip8->DMP_path, sizeof(chip8->DMP_path) - 1, "%s.dmp", filename);
@@ -196,428 +508,341 @@ void chip8_load_rom_buffer(CHIP8 *chip8, const void *raw, size_t sz) {
     size_t maxsz = MAX_RAM - chip8->pc_start_addr;
     size_t realsz = maxsz < sz ? maxsz : sz;
     memcpy(chip8->RAM + chip8->pc_start_addr, raw, realsz);
+    chip8_invalidate_code(chip8, chip8->pc_start_addr, realsz);
+#ifdef CHIP8_AOT
+    chip8_aot_load(chip8);
+#endif
 
     chip8->ROM_path[0] = '\0';
     chip8->UF_path[0] = '\0';
     chip8->DMP_path[0] = '\0';
 }
 
-bool chip8_cycle(CHIP8 *chip8)
+/* Instructions left until a counter advancing freq per instruction (freq 0
+meaning every instruction) reaches cpu_freq. */
+static uint32_t chip8_instructions_to_tick(const CHIP8 *chip8, uint64_t cum,
+                                           unsigned long freq)
 {
-    bool executed = false;
-    chip8_update_elapsed_time(chip8);
-
-    // Slow the CPU down to match given CPU frequency.
-    chip8->cpu_cum += chip8->total_cycle_time;
-    if (!chip8->cpu_freq || chip8->cpu_cum >= chip8->cpu_max_cum)
+    if (!freq || freq >= chip8->cpu_freq || cum >= chip8->cpu_freq)
     {
-        chip8->cpu_cum = 0;
-        chip8_execute(chip8);
-        executed = true;
+        return 1;
     }
 
-    chip8_handle_timers(chip8);
-    return executed;
+    return (uint32_t)((chip8->cpu_freq - cum + freq - 1) / freq);
 }
 
-void chip8_execute(CHIP8 *chip8)
+/* Advances the deterministic timers by n instructions, ticking DT and ST
+once per cpu_freq / timer_freq instructions and setting display_updated
+once per cpu_freq / refresh_freq instructions. */
+static void chip8_count_instructions(CHIP8 *chip8, uint32_t n)
 {
-    /* Fetch */
-    // The first and second byte of instruction respectively.
-    uint8_t b1 = chip8->RAM[chip8->PC],
-            b2 = chip8->RAM[chip8->PC + 1];
-
-    /* Decode */
-    // The code (first 4 bits) of instruction.
-    uint8_t c = b1 >> 4;
-
-    // The last 12 bits of instruction.
-    uint16_t nnn = ((b1 & 0xF) << 8) | b2;
-
-    // The last 4 bits of instruction.
-    uint8_t n = b2 & 0xF;
-
-    // The last 4 bits of first byte of instruction.
-    uint8_t x = b1 & 0xF;
+    if (!chip8->cpu_freq)
+    {
+        return;
+    }
 
-    // The first 4 bits of second byte of instruction.
-    uint8_t y = b2 >> 4;
+    unsigned long timer_freq = chip8->timer_freq ? chip8->timer_freq : chip8->cpu_freq;
+    unsigned long refresh_freq = chip8->refresh_freq ? chip8->refresh_freq : chip8->cpu_freq;
 
-    // The last 8 bits of instruction.
-    uint8_t kk = b2;
+    chip8->timer_instr_cum += (uint64_t)n * timer_freq;
+    for (; chip8->timer_instr_cum >= chip8->cpu_freq; chip8->timer_instr_cum -= chip8->cpu_freq)
+    {
+        if (chip8->DT > 0)
+        {
+            chip8->DT--;
+        }
+        if (chip8->ST > 0)
+        {
+            chip8->ST--;
+        }
+    }
 
-    /* Immediately set PC to next instruction
-    after fetching and decoding the current one. */
-    chip8->PC += 2;
+    chip8->beep = chip8->ST > 0;
 
-    /* Execute */
-    switch (c)
+    chip8->refresh_instr_cum += (uint64_t)n * refresh_freq;
+    if (chip8->refresh_instr_cum >= chip8->cpu_freq)
     {
-    case 0x00:
-        switch (b2)
-        {
-        /* HALT (0000)
-           Halt the emulator. */
-        case 0x00:
-            chip8->PC -= 2;
-            break;
+        chip8->display_updated = true;
+        chip8->refresh_instr_cum %= chip8->cpu_freq;
+    }
+}
 
-        /* CLS (00E0)
-           Clear the display. */
-        case 0xE0:
-            chip8_reset_display(chip8, chip8->bitplane);
-            break;
+bool chip8_cycle(CHIP8 *chip8)
+{
+    bool executed = false;
+    chip8_update_elapsed_time(chip8);
 
-        /* RET (00EE):
-           Return from a subroutine. */
-        case 0xEE:
-            chip8->PC = (chip8->RAM[chip8->SP] << 8);
-            chip8->PC |= chip8->RAM[chip8->SP + 1];
-            chip8->SP -= 2;
-            break;
+    /* Slow the CPU down to match given CPU frequency. At most one
+    instruction runs per call, so whole periods beyond it are dropped. */
+    chip8->cpu_cum += chip8->total_cycle_time * chip8->cpu_freq;
+    if (!chip8->cpu_freq || chip8->cpu_cum >= chip8->time_base)
+    {
+        chip8->cpu_cum %= chip8->time_base;
+        chip8_execute(chip8);
+        executed = true;
+    }
 
-        /* SCRR (00FB) (S-CHIP Only):
-           Scroll the display right by 4 pixels. */
-        case 0xFB:
-            chip8_scroll(chip8, 1, 0, 4, chip8->bitplane);
-            break;
+    if (!chip8->deterministic)
+    {
+        chip8_handle_timers(chip8);
+    }
+    else if (executed)
+    {
+        chip8_count_instructions(chip8, 1);
+    }
 
-        /* SCRL (00FC) (S-CHIP Only):
-           Scroll the display left by 4 pixels. */
-        case 0xFC:
-            chip8_scroll(chip8, -1, 0, 4, chip8->bitplane);
-            break;
+    return executed;
+}
 
-        /* EXIT (00FD) (S-CHIP Only):
-           Exit the interpreter. */
-        case 0xFD:
-            chip8->exit = true;
-            break;
+CHIP8RUN chip8_run(CHIP8 *chip8, uint32_t max_instructions, uint32_t *executed)
+{
+    uint8_t (*execute)(CHIP8 *chip8) = chip8_executors[chip8->quirk_profile];
+    CHIP8RUN result = chip8->exit ? RUN_EXIT : RUN_BUDGET;
+    uint32_t n = 0;
+
+    /* Keys released since the last call must be seen (and then cleared) by
+    exactly one instruction, which the interpreter runs. Translated and
+    compiled code never sees a released key. */
+    bool keys_released = false;
+    for (int k = 0; k < NUM_KEYS; k++)
+    {
+        keys_released |= (chip8->keypad[k] == KEY_RELEASED);
+    }
 
-        /* LORES (00FE) (S-CHIP Only):
-           Disable HI-RES mode. */
-        case 0xFE:
-            chip8->hires = false;
+    /* A halted machine, or a waiting Fx0A without a released key, would only
+    execute the same instruction again, so the budget goes by without
+    dispatching anything. */
+    if (chip8->state != STATE_RUNNING && result == RUN_BUDGET)
+    {
+        uint8_t b1 = chip8->RAM[chip8->PC];
+        uint8_t b2 = chip8->RAM[chip8->PC + 1];
+        bool halted = chip8->state == STATE_HALTED && b1 == 0x00 && b2 == 0x00;
+        bool waiting = chip8->state == STATE_KEY_WAIT && (b1 & 0xF0) == 0xF0 && b2 == 0x0A;
 
-            if (!chip8->quirks[5])
+        if (!halted && !waiting)
+        {
+            // PC or RAM was changed from outside (debugger, frontend).
+            chip8->state = STATE_RUNNING;
+        }
+        else if (halted || !keys_released)
+        {
+            if (executed != NULL)
             {
-                chip8_reset_display(chip8, chip8->bitplane);
+                *executed = max_instructions;
             }
 
-            break;
-
-        /* HIRES (00FF) (S-CHIP Only):
-           Enable HI-RES mode. */
-        case 0xFF:
-            chip8->hires = true;
+            return halted ? RUN_HALT : RUN_KEY_WAIT;
+        }
+    }
 
-            if (!chip8->quirks[5])
+    while (n < max_instructions && result == RUN_BUDGET)
+    {
+        /* Neither the translated nor the compiled code runs any instruction
+        reported in chip8_run_events, leaving those to the interpreter. */
+        if (!keys_released)
+        {
+            uint32_t k = 0;
+#ifdef CHIP8_AOT
+            k = chip8_aot_execute(chip8, max_instructions - n);
+#endif
+#ifdef CHIP8_DYNAREC
+            if (k == 0)
             {
-                chip8_reset_display(chip8, chip8->bitplane);
+                k = chip8_dynarec_execute(chip8, max_instructions - n);
             }
-
-            break;
-
-        default:
-            switch (y)
+#endif
+            if (k > 0)
             {
-            /* SCRD (00Cn) (S-CHIP Only):
-               Scroll the display down by n pixels. */
-            case 0xC:
-                chip8_scroll(chip8, 0, 1, n, chip8->bitplane);
-                break;
-
-            /* SCRU (00Dn) (S-CHIP Only):
-               Scroll the display up by n pixels. */
-            case 0xD:
-                chip8_scroll(chip8, 0, -1, n, chip8->bitplane);
-                break;
+                n += k;
+                continue;
             }
-
-            break;
         }
 
-        break;
-
-    /* JP addr (1nnn)
-       Jump to location nnn. */
-    case 0x01:
-        chip8->PC = nnn;
-        break;
-
-    /* CALL addr (2nnn)
-       Call subroutine at nnn. */
-    case 0x02:
-        chip8->SP += 2;
-        chip8->RAM[chip8->SP] = chip8->PC >> 8;
-        chip8->RAM[chip8->SP + 1] = chip8->PC & 0x00FF;
-        chip8->PC = nnn;
-        break;
+        uint16_t pc = chip8->PC;
+        uint8_t op = execute(chip8);
+        n++;
 
-    /* SE Vx, byte (3xkk)
-       Skip next instruction if Vx = kk. */
-    case 0x03:
-        if (chip8->V[x] == kk)
+        if (keys_released)
         {
-            chip8_skip_instr(chip8);
+            chip8_reset_released_keys(chip8);
+            keys_released = false;
         }
 
-        break;
+        result = chip8_run_events[op];
 
-    /* SNE Vx, byte (4xkk)
-       Skip next instruction if Vx != kk. */
-    case 0x04:
-        if (chip8->V[x] != kk)
+        // Fx0A only waits if no key was released.
+        if (result == RUN_KEY_WAIT && chip8->state != STATE_KEY_WAIT)
         {
-            chip8_skip_instr(chip8);
+            result = RUN_BUDGET;
         }
 
-        break;
-
-    case 0x05:
-        switch (n)
+        // Waiting and halting use up the budget.
+        if (result == RUN_KEY_WAIT || result == RUN_HALT)
         {
-        /* SE Vx, Vy (5xy0)
-           Skip next instruction if Vx = Vy. */
-        case 0x0:
-            if (chip8->V[x] == chip8->V[y])
-            {
-                chip8_skip_instr(chip8);
-            }
-
-            break;
-
-        /* LD [I], Vx - Vy (5xy2) (XO-CHIP Only)
-           Store registers Vx through Vy in memory starting at location I. */
-        case 0x2:
-            if (y >= x)
-            {
-                for (int r = 0; r <= (y - x); r++)
-                {
-                    chip8->RAM[chip8->I + r] = chip8->V[x + r];
-                }
-            }
-            else
-            {
-                for (int r = 0; r <= (x - y); r++)
-                {
-                    chip8->RAM[chip8->I + r] = chip8->V[x - r];
-                }
-            }
+            n = max_instructions;
+        }
 
-            break;
+        /* Once LD Vx, DT at the head of an idle loop has run, every further
+        iteration of the loop (skip, jump, LD Vx, DT) leaves the machine just
+        as it is until DT changes, which only happens between calls. */
+        if (op == OP_LD_VX_DT && chip8_is_idle_loop(chip8->RAM, pc))
+        {
+            bool se = (chip8->RAM[pc + 2] & 0xF0) == 0x30;
+            uint8_t kk = chip8->RAM[pc + 3];
+            uint8_t x = chip8->RAM[pc] & 0x0F;
+            uint32_t skipped = (max_instructions - n) / 3 * 3;
 
-        /* LD Vx - Vy, [I] (5xy3) (XO-CHIP Only)
-           Read registers Vx through Vy from memory starting at location I. */
-        case 0x3:
-            if (y >= x)
-            {
-                for (int r = 0; r <= (y - x); r++)
-                {
-                    chip8->V[x + r] = chip8->RAM[chip8->I + r];
-                }
-            }
-            else
+            if ((chip8->V[x] != kk) == se && skipped > 0)
             {
-                for (int r = 0; r <= (x - y); r++)
-                {
-                    chip8->V[x - r] = chip8->RAM[chip8->I + r];
-                }
+                n += skipped;
+                chip8->idle_instrs += skipped;
+                result = RUN_IDLE;
             }
-
-            break;
         }
+    }
 
-        break;
+    if (executed != NULL)
+    {
+        *executed = n;
+    }
 
-    /* LD Vx, byte (6xkk)
-       Set Vx = kk. */
-    case 0x06:
-        chip8->V[x] = kk;
-        break;
+    return result;
+}
 
-    /* ADD Vx, byte (7xkk)
-       Set Vx = Vx + kk. */
-    case 0x07:
-        chip8->V[x] += kk;
-        break;
+uint32_t chip8_execute_instrs(CHIP8 *chip8, uint32_t max_instructions)
+{
+    uint32_t executed = 0;
 
-    case 0x08:
-        switch (n)
-        {
-        /* LD Vx, Vy (8xy0)
-           Set Vx = Vy. */
-        case 0x00:
-            chip8->V[x] = chip8->V[y];
-            break;
+    while (executed < max_instructions && !chip8->exit)
+    {
+        uint32_t n;
+        chip8_run(chip8, max_instructions - executed, &n);
+        executed += n;
+    }
 
-        /* OR Vx, Vy (8xy1)
-           Set Vx = Vx OR Vy.
-           Legacy: Set VF = 0.
-           S-CHIP: Leave VF alone. */
-        case 0x01:
-            chip8->V[x] |= chip8->V[y];
+    return executed;
+}
 
-            if (!chip8->quirks[9])
-            {
-                chip8->V[0x0F] = 0;
-            }
-            break;
+uint32_t chip8_run_deterministic(CHIP8 *chip8, uint32_t max_instructions)
+{
+    uint32_t executed = 0;
+    chip8->display_updated = false;
 
-        /* AND Vx, Vy (8xy2)
-           Set Vx = Vx AND Vy.
-           Legacy: Set VF = 0.
-           S-CHIP: Leave VF alone. */
-        case 0x02:
-            chip8->V[x] &= chip8->V[y];
-            
-            if (!chip8->quirks[9])
-            {
-                chip8->V[0x0F] = 0;
-            }
-            break;
+    while (executed < max_instructions && !chip8->exit)
+    {
+        /* Stop at the next event so it lands on the exact instruction (and a
+        delay timer polling loop is skipped only up to it). */
+        uint32_t budget = max_instructions - executed;
+        uint32_t to_event = chip8_instructions_to_event(chip8);
+        budget = (to_event < budget) ? to_event : budget;
+
+        uint32_t n;
+        chip8_run(chip8, budget, &n);
+        chip8_count_instructions(chip8, n);
+        executed += n;
+    }
 
-        /* XOR Vx, Vy (8xy3)
-           Set Vx = Vx XOR Vy.
-           Legacy: Set VF = 0.
-           S-CHIP: Leave VF alone. */
-        case 0x03:
-            chip8->V[x] ^= chip8->V[y];
-            
-            if (!chip8->quirks[9])
-            {
-                chip8->V[0x0F] = 0;
-            }
-            break;
+    return executed;
+}
 
-        /* ADD Vx, Vy (8xy4)
-           Set Vx = Vx + Vy, set VF = carry. */
-        case 0x04:
-        {
-            bool carry = ((chip8->V[x] + chip8->V[y]) > 0xFF);
-            chip8->V[x] += chip8->V[y];
-            chip8->V[0x0F] = carry;
-            break;
-        }
+uint32_t chip8_instructions_to_event(const CHIP8 *chip8)
+{
+    if (!chip8->cpu_freq)
+    {
+        return UINT32_MAX;
+    }
 
-        /* SUB Vx, Vy (8xy5)
-           Set Vx = Vx - Vy, set VF = NOT borrow. */
-        case 0x05:
-        {
-            bool no_borrow = (chip8->V[x] >= chip8->V[y]);
-            chip8->V[x] = chip8->V[x] - chip8->V[y];
-            chip8->V[0x0F] = no_borrow;
-            break;
-        }
+    uint32_t to_timer = chip8_instructions_to_tick(chip8, chip8->timer_instr_cum,
+                                                   chip8->timer_freq);
+    uint32_t to_refresh = chip8_instructions_to_tick(chip8, chip8->refresh_instr_cum,
+                                                     chip8->refresh_freq);
+    return (to_timer < to_refresh) ? to_timer : to_refresh;
+}
 
-        /* SHR Vx {, Vy} (8xy6)
-           Legacy: Set Vx = Vy SHR 1.
-           S-CHIP: Set Vx = Vx SHR 1. */
-        case 0x06:
-        {
-            if (!chip8->quirks[1])
-            {
-                chip8->V[x] = chip8->V[y];
-            }
+void chip8_execute(CHIP8 *chip8)
+{
+    chip8_executors[chip8->quirk_profile](chip8);
 
-            int carry = chip8->V[x] & 0x01;
-            chip8->V[x] >>= 1;
-            chip8->V[0x0F] = carry;
-            break;
-        }
+    // Any key that was released previous frame gets turned off.
+    chip8_reset_released_keys(chip8);
+}
 
-        /* SUBN Vx, Vy (8xy7)
-           Set Vx = Vy - Vx, set VF = NOT borrow. */
-        case 0x07:
-        {
-            bool no_borrow = (chip8->V[y] >= chip8->V[x]);
-            chip8->V[x] = chip8->V[y] - chip8->V[x];
-            chip8->V[0x0F] = no_borrow;
-            break;
-        }
+// Maps an instruction to its operation by walking the opcode groups.
+static uint8_t chip8_decode_op(uint8_t b1, uint8_t b2)
+{
+    // The code (first 4 bits) of instruction.
+    uint8_t c = b1 >> 4;
 
-        /* SHL Vx {, Vy} (8xyE)
-           Legacy: Set Vx = Vy SHL 1.
-           S-CHIP: Set Vx = Vx SHL 1. */
-        case 0x0E:
+    switch (c)
+    {
+    case 0x00:
+        switch (b2)
         {
-            if (!chip8->quirks[1])
+        case 0x00: return OP_HALT;
+        case 0xE0: return OP_CLS;
+        case 0xEE: return OP_RET;
+        case 0xFB: return OP_SCRR;
+        case 0xFC: return OP_SCRL;
+        case 0xFD: return OP_EXIT;
+        case 0xFE: return OP_LORES;
+        case 0xFF: return OP_HIRES;
+        default:
+            switch (b2 >> 4)
             {
-                chip8->V[x] = chip8->V[y];
+            case 0xC: return OP_SCRD;
+            case 0xD: return OP_SCRU;
             }
 
-            //chip8->V[0x0F] = (chip8->V[x] & 0x80) >> 7;
-            int carry = (chip8->V[x] & 0x80) >> 7;
-            chip8->V[x] <<= 1;
-            chip8->V[0x0F] = carry;
             break;
         }
-        }
 
         break;
 
-    /* SNE Vx, Vy (9xy0)
-       Skip next instruction if Vx != Vy. */
-    case 0x09:
-        if (chip8->V[x] != chip8->V[y])
+    case 0x01: return OP_JP;
+    case 0x02: return OP_CALL;
+    case 0x03: return OP_SE_BYTE;
+    case 0x04: return OP_SNE_BYTE;
+
+    case 0x05:
+        switch (b2 & 0xF)
         {
-            chip8_skip_instr(chip8);
+        case 0x0: return OP_SE_REG;
+        case 0x2: return OP_SAVE_RANGE;
+        case 0x3: return OP_LOAD_RANGE;
         }
 
         break;
 
-    /* LD I, addr (Annn)
-       Set I = nnn. */
-    case 0x0A:
-        chip8->I = nnn;
-        break;
+    case 0x06: return OP_LD_BYTE;
+    case 0x07: return OP_ADD_BYTE;
 
-    /* JP V0, addr (Bnnn)
-       Legacy: Jump to location nnn + V0.
-       S-CHIP: Jump to location nnn + Vx. */
-    case 0x0B:
-        chip8->PC = (!chip8->quirks[3]) ? chip8->V[0] + nnn : chip8->V[x] + nnn;
-        break;
+    case 0x08:
+        switch (b2 & 0xF)
+        {
+        case 0x00: return OP_LD_REG;
+        case 0x01: return OP_OR;
+        case 0x02: return OP_AND;
+        case 0x03: return OP_XOR;
+        case 0x04: return OP_ADD_REG;
+        case 0x05: return OP_SUB;
+        case 0x06: return OP_SHR;
+        case 0x07: return OP_SUBN;
+        case 0x0E: return OP_SHL;
+        }
 
-    /* RND Vx, byte (Cxkk)
-       Set Vx = random byte AND kk. */
-    case 0x0C:
-        chip8->V[x] = (rand() % 0x100) & kk;
         break;
 
-    /* DRW Vx, Vy, n (Dxyn):
-       Legacy: Display n-byte sprite starting at memory location I at (Vx, Vy),
-       set VF = collision.
-       S-CHIP: If hires=false: If n=0, display 8x16 sprite. Else:
-       Same as Legacy. If hires=true: Same as Legacy, except
-       set VF = num rows collision. If n=0: Display 16x16 sprite starting at
-       memory location I at (Vx, Vy), set VF = num rows collision. */
-    case 0x0D:
-        chip8_draw(chip8, chip8->V[x], chip8->V[y], n, chip8->bitplane);
-        break;
+    case 0x09: return OP_SNE_REG;
+    case 0x0A: return OP_LD_I;
+    case 0x0B: return OP_JP_V0;
+    case 0x0C: return OP_RND;
+    case 0x0D: return OP_DRW;
 
     case 0x0E:
         switch (b2)
         {
-        /* SKP Vx (Ex9E)
-           Skip next instruction if key with the value of Vx is pressed. */
-        case 0x9E:
-            if (chip8->keypad[chip8->V[x]] == KEY_DOWN)
-            {
-                chip8_skip_instr(chip8);
-            }
-
-            break;
-
-        /* SKNP Vx (ExA1)
-           Skip next instruction if key with the value of Vx is not pressed. */
-        case 0xA1:
-            if (chip8->keypad[chip8->V[x]] == KEY_UP)
-            {
-                chip8_skip_instr(chip8);
-            }
-
-            break;
+        case 0x9E: return OP_SKP;
+        case 0xA1: return OP_SKNP;
         }
 
         break;
@@ -625,154 +850,121 @@ void chip8_execute(CHIP8 *chip8)
     case 0x0F:
         switch (b2)
         {
-        /* LD I, nnnn (XO-CHIP Only)
-           Set I = 16-bit address (stored in next two bytes). */
-        case 0x00:
-            chip8->I = (chip8->RAM[chip8->PC]) << 8;
-            chip8->I |= (chip8->RAM[chip8->PC + 1]);
-            chip8->PC += 2;
-            break;
-
-        /* PLANE n (XO-CHIP Only)
-           Set the bitplane where 0 <= n <= 3. */
-        case 0x01:
-            if (x > NUM_BITPLANES)
-            {
-                x = NUM_BITPLANES;
-            }
-
-            chip8->bitplane = (CHIP8BP) x;
-            break;
-
-        /* AUDIO (XO-CHIP Only)
-           Store bytes starting at I in the audio pattern buffer. */
-        case 0x02:
-            for (int i = 0; i < AUDIO_BUF_SIZE; i++)
-            {
-                chip8->RAM[AUDIO_BUF_ADDR + i] = chip8->RAM[chip8->I + i];
-            }
-
-            break;
-
-        /* LD Vx, DT (Fx07)
-           Set Vx = delay timer value. */
-        case 0x07:
-            chip8->V[x] = chip8->DT;
-            break;
-
-        /* LD Vx, K (Fx0A)
-           Wait for a key press, store the value of the key in Vx. */
-        case 0x0A:
-        {
-            chip8_wait_key(chip8, x);
-            break;
+        case 0x00: return OP_LD_I_LONG;
+        case 0x01: return OP_PLANE;
+        case 0x02: return OP_AUDIO;
+        case 0x07: return OP_LD_VX_DT;
+        case 0x0A: return OP_LD_VX_K;
+        case 0x15: return OP_LD_DT;
+        case 0x18: return OP_LD_ST;
+        case 0x1E: return OP_ADD_I;
+        case 0x29: return OP_LD_F;
+        case 0x30: return OP_LD_HF;
+        case 0x33: return OP_LD_B;
+        case 0x3A: return OP_PITCH;
+        case 0x55: return OP_LD_MEM_VX;
+        case 0x65: return OP_LD_VX_MEM;
+        case 0x75: return OP_SAVE_FLAGS;
+        case 0x85: return OP_LOAD_FLAGS;
         }
 
-        /* LD DT, Vx (Fx15)
-           Set delay timer = Vx. */
-        case 0x15:
-            chip8->DT = chip8->V[x];
-            break;
+        break;
+    }
 
-        /* LD ST, Vx (Fx18)
-           Set sound timer = Vx. */
-        case 0x18:
-            chip8->ST = chip8->V[x];
-            break;
+    return OP_NOP;
+}
 
-        /* ADD I, Vx (Fx1E):
-           Set I = I + Vx. */
-        case 0x1E:
-            chip8->I += chip8->V[x];
-            break;
+#ifdef CHIP8_OPCODE_TABLE
+// Fills the opcode table by decoding every possible instruction once.
+static void chip8_build_opcode_table(void)
+{
+    for (int i = 0; i <= 0xFFFF; i++)
+    {
+        opcode_table[i] = chip8_decode_op(i >> 8, i & 0xFF);
+    }
 
-        /* LD F, Vx (Fx29)
-           Set I = location of 5-byte sprite for digit Vx. */
-        case 0x29:
-            chip8->I = FONT_START_ADDR + (chip8->V[x] * 0x05);
-            break;
+    opcode_table_ready = true;
+}
+#endif
 
-        /* LD HF, Vx (Fx30) (S-CHIP Only)
-           Set I = location of 10-byte sprite for digit Vx. */
-        case 0x30:
-            chip8->I = BIG_FONT_START_ADDR + (chip8->V[x] * 0x0A);
-            break;
+bool chip8_is_idle_loop(const uint8_t *RAM, uint16_t addr)
+{
+    // The jump back can only reach the first 4K.
+    if (addr > 0x0FFF)
+    {
+        return false;
+    }
 
-        /* LD B, Vx (Fx33)
-           Store BCD representation of Vx in memory locations:
-           I, I+1, and I+2. */
-        case 0x33:
-            chip8->RAM[chip8->I] = (chip8->V[x] / 100) % 10;
-            chip8->RAM[chip8->I + 1] = (chip8->V[x] / 10) % 10;
-            chip8->RAM[chip8->I + 2] = chip8->V[x] % 10;
-            break;
+    const uint8_t *p = RAM + addr;
+    uint8_t x = p[0] & 0x0F;
 
-        /* PITCH Vx (Fx3A) (XO-CHIP Only)
-           Set audio pitch to Vx. */
-        case 0x3A:
-            chip8->pitch = chip8->V[x];
-            break;
+    return (p[0] & 0xF0) == 0xF0 && p[1] == 0x07 &&
+           (p[2] == (0x30 | x) || p[2] == (0x40 | x)) &&
+           p[4] == (0x10 | (addr >> 8)) && p[5] == (addr & 0xFF);
+}
 
-        /* LD [I], Vx (Fx55)
-           Store registers V0 through Vx in memory starting at location I.
-           Legacy: Set I=I+x+1 */
-        case 0x55:
-            for (int r = 0; r <= x; r++)
-            {
-                chip8->RAM[chip8->I + r] = chip8->V[r];
-            }
+void chip8_decode(CHIP8INSTR *instr, uint8_t b1, uint8_t b2)
+{
+    // The last 12 bits of instruction.
+    instr->nnn = ((b1 & 0xF) << 8) | b2;
 
-            if (!chip8->quirks[2])
-            {
-                chip8->I += (x + 1);
-            }
+    // The last 4 bits of instruction.
+    instr->n = b2 & 0xF;
 
-            break;
+    // The last 4 bits of first byte of instruction.
+    instr->x = b1 & 0xF;
 
-        /* LD Vx, [I] (Fx65)
-           Read registers V0 through Vx from memory starting at location I.
-           Legacy: Set I=I+x+1 */
-        case 0x65:
-            for (int r = 0; r <= x; r++)
-            {
-                chip8->V[r] = chip8->RAM[chip8->I + r];
-            }
+    // The first 4 bits of second byte of instruction.
+    instr->y = b2 >> 4;
 
-            if (!chip8->quirks[2])
-            {
-                chip8->I += (x + 1);
-            }
+    // The last 8 bits of instruction.
+    instr->kk = b2;
 
-            break;
+#ifdef CHIP8_OPCODE_TABLE
+    if (!opcode_table_ready)
+    {
+        chip8_build_opcode_table();
+    }
 
-        /* LD uflags_disk, V0..Vx (Fx75) (S-CHIP Only)
-           Save user flags to disk. */
-        case 0x75:
-            if (!chip8_handle_user_flags(chip8, x + 1, true))
-            {
-                fprintf(stderr, "Unable to save user flags to %s\n",
-                        chip8->UF_path);
-            }
+    instr->op = opcode_table[(b1 << 8) | b2];
+#else
+    instr->op = chip8_decode_op(b1, b2);
+#endif
+}
 
-            break;
+void chip8_invalidate_code(CHIP8 *chip8, uint16_t addr, size_t len)
+{
+#ifdef CHIP8_DYNAREC
+    chip8_dynarec_invalidate(chip8, addr, len);
+#endif
 
-        /* LD V0..Vx, uflags_disk (Fx85) (S-CHIP Only)
-           Load user flags from disk. */
-        case 0x85:
-            if (!chip8_handle_user_flags(chip8, x + 1, false))
-            {
-                fprintf(stderr, "Unable to load user flags from %s\n",
-                        chip8->UF_path);
-            }
+#ifdef CHIP8_AOT
+    chip8_aot_invalidate(chip8, addr, len);
+#endif
 
-            break;
-        }
+#ifndef CHIP8_NO_DECODE_CACHE
+    // Nothing is cached for a machine that isn't the current owner.
+    if (chip8 != decode_cache_owner || len == 0)
+    {
+        return;
+    }
 
-        break;
+    size_t end = addr + len;
+    if (end > MAX_RAM)
+    {
+        end = MAX_RAM;
     }
 
-    // Any key that was released previous frame gets turned off.
-    chip8_reset_released_keys(chip8);
+    // An entry at an even address covers that byte and the one after it.
+    for (size_t i = addr >> 1; i <= ((end - 1) >> 1); i++)
+    {
+        decode_cache[i].op = OP_NONE;
+    }
+#else
+    (void)chip8;
+    (void)addr;
+    (void)len;
+#endif
 }
 
 void chip8_handle_timers(CHIP8 *chip8)
@@ -780,12 +972,12 @@ void chip8_handle_timers(CHIP8 *chip8)
     // Delay
     if (chip8->DT > 0)
     {
-        chip8->delay_cum += chip8->total_cycle_time;
+        chip8->delay_cum += chip8->total_cycle_time * chip8->timer_freq;
 
-        if (!chip8->timer_freq || chip8->delay_cum >= chip8->timer_max_cum)
+        if (!chip8->timer_freq || chip8->delay_cum >= chip8->time_base)
         {
             chip8->DT--;
-            chip8->delay_cum = 0;
+            chip8->delay_cum %= chip8->time_base;
         }
     }
 
@@ -793,12 +985,12 @@ void chip8_handle_timers(CHIP8 *chip8)
     if (chip8->ST > 0)
     {
         chip8->beep = true;
-        chip8->sound_cum += chip8->total_cycle_time;
+        chip8->sound_cum += chip8->total_cycle_time * chip8->timer_freq;
 
-        if (!chip8->timer_freq || chip8->sound_cum >= chip8->timer_max_cum)
+        if (!chip8->timer_freq || chip8->sound_cum >= chip8->time_base)
         {
             chip8->ST--;
-            chip8->sound_cum = 0;
+            chip8->sound_cum %= chip8->time_base;
         }
     }
     else
@@ -808,18 +1000,19 @@ void chip8_handle_timers(CHIP8 *chip8)
 
     // Screen Refresh
     chip8->display_updated = false;
-    chip8->refresh_cum += chip8->total_cycle_time;
-    if (!chip8->refresh_freq || chip8->refresh_cum >= chip8->refresh_max_cum)
+    chip8->refresh_cum += chip8->total_cycle_time * chip8->refresh_freq;
+    if (!chip8->refresh_freq || chip8->refresh_cum >= chip8->time_base)
     {
         chip8->display_updated = true;
-        chip8->refresh_cum = 0;
+        chip8->refresh_cum %= chip8->time_base;
     }
 }
 
 void chip8_update_elapsed_time(CHIP8 *chip8)
 {
 #ifdef __LIBRETRO__
-    chip8->total_cycle_time = 1000000 / chip8->cpu_freq;
+    // Every cycle is one instruction.
+    chip8_set_cycle_time(chip8, 1, chip8->cpu_freq);
 #elif defined(WIN32)
     chip8->prev_cycle_start = chip8->cur_cycle_start;
 
@@ -829,12 +1022,8 @@ void chip8_update_elapsed_time(CHIP8 *chip8)
     chip8->win_cycle_time.QuadPart *= 1000000;
     chip8->win_cycle_time.QuadPart /= chip8->real_cpu_freq.QuadPart;
 
-    chip8->total_cycle_time = chip8->win_cycle_time.QuadPart;
-
-    if (chip8->total_cycle_time == 0)
-    {
-        chip8->total_cycle_time = 1;
-    }
+    chip8_set_cycle_time(chip8, chip8->win_cycle_time.QuadPart ? chip8->win_cycle_time.QuadPart : 1,
+                         ONE_SEC);
 #else
     chip8->prev_cycle_start.tv_sec = chip8->cur_cycle_start.tv_sec;
     chip8->prev_cycle_start.tv_usec = chip8->cur_cycle_start.tv_usec;
@@ -842,14 +1031,30 @@ void chip8_update_elapsed_time(CHIP8 *chip8)
     gettimeofday(&chip8->cur_cycle_start, NULL);
 
     // Calculate total cycle time in microseconds.
-    chip8->total_cycle_time = chip8->cur_cycle_start.tv_sec;
-    chip8->total_cycle_time -= chip8->prev_cycle_start.tv_sec;
-    chip8->total_cycle_time *= 1000000;
-    chip8->total_cycle_time += chip8->cur_cycle_start.tv_usec;
-    chip8->total_cycle_time -= chip8->prev_cycle_start.tv_usec;
+    int64_t elapsed = chip8->cur_cycle_start.tv_sec;
+    elapsed -= chip8->prev_cycle_start.tv_sec;
+    elapsed *= 1000000;
+    elapsed += chip8->cur_cycle_start.tv_usec;
+    elapsed -= chip8->prev_cycle_start.tv_usec;
+
+    chip8_set_cycle_time(chip8, (elapsed > 0) ? (uint64_t)elapsed : 0, ONE_SEC);
 #endif
 }
 
+void chip8_set_cycle_time(CHIP8 *chip8, uint64_t cycle_time, unsigned long time_base)
+{
+    if (time_base != chip8->time_base)
+    {
+        chip8->cpu_cum = chip8->cpu_cum * time_base / chip8->time_base;
+        chip8->sound_cum = chip8->sound_cum * time_base / chip8->time_base;
+        chip8->delay_cum = chip8->delay_cum * time_base / chip8->time_base;
+        chip8->refresh_cum = chip8->refresh_cum * time_base / chip8->time_base;
+        chip8->time_base = time_base;
+    }
+
+    chip8->total_cycle_time = cycle_time;
+}
+
 void chip8_reset_keypad(CHIP8 *chip8)
 {
     for (int k = 0; k < NUM_KEYS; k++)
@@ -871,264 +1076,345 @@ void chip8_reset_released_keys(CHIP8 *chip8)
 
 void chip8_reset_display(CHIP8 *chip8, CHIP8BP bitplane)
 {
-    if (bitplane == BPNONE)
+    if (bitplane != BPNONE)
+    {
+        chip8->dirty_rows = DISPLAY_ALL_ROWS;
+    }
+
+    if (bitplane == BP1 || bitplane == BPBOTH)
+    {
+        memset(chip8->display, 0, sizeof(chip8->display));
+        memset(chip8->lores, 0, sizeof(chip8->lores));
+    }
+    if (bitplane == BP2 || bitplane == BPBOTH)
+    {
+        memset(chip8->display2, 0, sizeof(chip8->display2));
+        memset(chip8->lores2, 0, sizeof(chip8->lores2));
+    }
+
+    if (chip8->lores_native || chip8->hires)
     {
         return;
     }
 
+    // A blank lores display can be drawn at native resolution again.
+    uint64_t lit = 0;
     for (int y = 0; y < DISPLAY_HEIGHT; y++)
     {
-        for (int x = 0; x < DISPLAY_WIDTH; x++)
+        for (int w = 0; w < DISPLAY_ROW_WORDS; w++)
         {
-            if (bitplane == BP1 || bitplane == BPBOTH)
-            {
-                chip8->display[y][x] = false;
-            }
-            if (bitplane == BP2 || bitplane == BPBOTH)
-            {
-                chip8->display2[y][x] = false;
-            }
+            lit |= chip8->display[y][w] | chip8->display2[y][w];
         }
     }
-}
 
-void chip8_reset_RAM(CHIP8 *chip8)
-{
-    for (int i = 0; i < MAX_RAM; i++)
+    if (!lit)
     {
-        chip8->RAM[i] = 0x00;
+        memset(chip8->lores, 0, sizeof(chip8->lores));
+        memset(chip8->lores2, 0, sizeof(chip8->lores2));
+        chip8->lores_dirty = 0;
+        chip8->lores_native = true;
     }
 }
 
-void chip8_reset_registers(CHIP8 *chip8)
+void chip8_sync_display(CHIP8 *chip8)
 {
-    for (int i = 0; i < NUM_REGISTERS; i++)
+    if (!chip8->lores_native || !chip8->lores_dirty)
     {
-        chip8->V[i] = 0x00;
+        return;
     }
-}
 
-void chip8_reset_audio(CHIP8 *chip8)
-{
-    for (int i = AUDIO_BUF_ADDR; i < AUDIO_BUF_ADDR + AUDIO_BUF_SIZE; i++)
+    for (int y = 0; y < LORES_HEIGHT; y++)
     {
-        if (i < (AUDIO_BUF_ADDR + 8))
+        if (!(chip8->lores_dirty & ((uint32_t)1 << y)))
         {
-            chip8->RAM[i] = 0x00;
+            continue;
         }
-        else
+
+        for (int h = 0; h < 2; h++)
         {
-            chip8->RAM[i] = 0xFF;
+            chip8->display[(y * 2) + h][0] = chip8_upscale_word(chip8->lores[y] >> 32);
+            chip8->display[(y * 2) + h][1] = chip8_upscale_word((uint32_t)chip8->lores[y]);
+            chip8->display2[(y * 2) + h][0] = chip8_upscale_word(chip8->lores2[y] >> 32);
+            chip8->display2[(y * 2) + h][1] = chip8_upscale_word((uint32_t)chip8->lores2[y]);
         }
     }
+
+    chip8->lores_dirty = 0;
 }
 
-void chip8_load_instr(CHIP8 *chip8, uint16_t instr)
+void chip8_set_hires(CHIP8 *chip8, bool hires)
 {
-    chip8->RAM[chip8->pc_start_addr] = instr >> 8;
-    chip8->RAM[chip8->pc_start_addr + 1] = instr & 0x00FF;
+    if (hires && chip8->lores_native)
+    {
+        chip8_leave_lores(chip8);
+    }
+
+    chip8->hires = hires;
 }
 
-void chip8_draw(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n, CHIP8BP bitplane)
+bool chip8_get_pixel(const CHIP8 *chip8, CHIP8BP bitplane, int x, int y)
 {
-    // This function is ugly and could probably use some refactoring...
+    bool on = false;
 
-    if (bitplane == BPNONE)
+    if (chip8->lores_native)
     {
-        return;
+        if (bitplane == BP1 || bitplane == BPBOTH)
+        {
+            on |= DISPLAY_PIXEL(&chip8->lores[y >> 1], x >> 1);
+        }
+        if (bitplane == BP2 || bitplane == BPBOTH)
+        {
+            on |= DISPLAY_PIXEL(&chip8->lores2[y >> 1], x >> 1);
+        }
+
+        return on;
+    }
+
+    if (bitplane == BP1 || bitplane == BPBOTH)
+    {
+        on |= DISPLAY_PIXEL(chip8->display[y], x);
+    }
+    if (bitplane == BP2 || bitplane == BPBOTH)
+    {
+        on |= DISPLAY_PIXEL(chip8->display2[y], x);
     }
 
-    chip8->V[0x0F] = 0;
-    int rows;
+    return on;
+}
+
+void chip8_set_pixel(CHIP8 *chip8, CHIP8BP bitplane, int x, int y, bool on)
+{
+    uint64_t bit = (uint64_t)1 << (63 - (x & 63));
+    chip8->dirty_rows |= (uint64_t)1 << y;
 
-    /* n==0 only has signifigance in S-CHIP mode,
-    otherwise nothing should be drawn. */
-    if (n == 0)
+    // A single display pixel is only half a lores pixel.
+    if (chip8->lores_native)
     {
-        /* Draw a 32-byte (16x16) sprite in hires or
-        a 16-byte (8x16) sprite in lores. */
-        n = (chip8->hires || !chip8->quirks[4]) ? 32 : 16;
+        chip8_leave_lores(chip8);
     }
 
-    if (chip8->hires && chip8->quirks[8])
+    if (bitplane == BP1 || bitplane == BPBOTH)
     {
-        rows = (n == 32) ? 16 : n;
-        chip8->V[0x0F] += ((y + rows) - (DISPLAY_HEIGHT - 1));
+        chip8->display[y][x >> 6] = on ? (chip8->display[y][x >> 6] | bit)
+                                       : (chip8->display[y][x >> 6] & ~bit);
     }
-    else
+    if (bitplane == BP2 || bitplane == BPBOTH)
     {
-        rows = n;
+        chip8->display2[y][x >> 6] = on ? (chip8->display2[y][x >> 6] | bit)
+                                        : (chip8->display2[y][x >> 6] & ~bit);
     }
+}
 
-    /*// Allow out-of-bound sprite to wrap-around.
-    if (!chip8->quirks[6])
-    {
-        y %= DISPLAY_HEIGHT;
-        x %= DISPLAY_WIDTH;
-    }*/
+uint64_t chip8_get_dirty_rows(const CHIP8 *chip8)
+{
+    return chip8->dirty_rows;
+}
+
+void chip8_clear_dirty_rows(CHIP8 *chip8)
+{
+    chip8->dirty_rows = 0;
+}
 
-    bool prev_byte_collide = false;
+void chip8_mark_display_dirty(CHIP8 *chip8)
+{
+    chip8->dirty_rows = DISPLAY_ALL_ROWS;
+}
 
-    for (int i = 0; i < n; i++)
+void chip8_reset_RAM(CHIP8 *chip8)
+{
+    for (int i = 0; i < MAX_RAM; i++)
     {
-        bool collide_row = false;
+        chip8->RAM[i] = 0x00;
+    }
 
-        for (int j = 0; j < 8; j++)
-        {
-            /* For big sprites, every odd byte needs to be drawn on the same
-            row as the previous byte. This is achieved through integer division
-            truncation. The odd byte also needs to be drawn 8 pixels to the
-            right of the previous byte. */
-            unsigned y_start = (n == 32) ? (i / 2) : i;
-            unsigned x_start = (n == 32 && (i % 2 != 0)) ? (j + 8) : j;
-
-            /* Now we have to scale the display if we are in lo-res mode
-            by basically drawing each pixel twice. */
-            int scale = chip8->hires ? 1 : 2;
-            for (int h = 0; h < scale; h++)
-            {
-                for (int k = 0; k < scale; k++)
-                {
-                    int disp_x = (x * scale) + (x_start * scale) + k;
-                    int disp_y = (y * scale) + (y_start * scale) + h;
-
-                    if (!chip8->quirks[6])
-                    {
-                        disp_y %= DISPLAY_HEIGHT;
-                        disp_x %= DISPLAY_WIDTH;
-                    }
-                    else if (disp_x >= DISPLAY_WIDTH || disp_y >= DISPLAY_HEIGHT)
-                    {
-                        break;
-                    }
-
-                    bool pixel_on = false;
-                    bool bit = false;
-                    bool collide = false;
-
-                    /* Get the pixel the loop is on and the corresponding bit
-                    and XOR them onto display. If a pixel is erased, set the VF
-                    register to 1. */
-                    if (bitplane == BP1 || bitplane == BPBOTH)
-                    {
-                        pixel_on = chip8->display[disp_y][disp_x];
-                        bit = (chip8->RAM[chip8->I + i] >> (7 - j)) & 0x01;
-                        collide = pixel_on && bit;
-                        chip8->display[disp_y][disp_x] = (pixel_on ^ bit);
-                    }
-                    if (bitplane == BP2)
-                    {
-                        pixel_on = chip8->display2[disp_y][disp_x];
-                        bit = (chip8->RAM[chip8->I + i] >> (7 - j)) & 0x01;
-                        collide = pixel_on && bit;
-                        chip8->display2[disp_y][disp_x] = (pixel_on ^ bit);
-                    }
-                    if (bitplane == BPBOTH)
-                    {
-                        pixel_on = chip8->display2[disp_y][disp_x];
-                        bit = (chip8->RAM[chip8->I + rows + i] >> (7 - j)) & 0x01;
-                        chip8->display2[disp_y][disp_x] = (pixel_on ^ bit);
-
-                        if (!collide)
-                        {
-                            collide = pixel_on && bit;
-                        }
-                    }
-
-                    if (collide)
-                    {
-                        if (chip8->hires && chip8->quirks[7])
-                        {
-                            if (!collide_row)
-                            {
-                                if (n <= 16 || (((i % 2 == 0) && n == 32) ||
-                                                !prev_byte_collide))
-                                {
-                                    chip8->V[0x0F]++;
-                                    collide_row = true;
-                                }
-                            }
-                        }
-                        else
-                        {
-                            chip8->V[0x0F] = 1;
-                        }
-                    }
-                }
-            }
-        }
+    chip8_invalidate_code(chip8, 0, MAX_RAM);
+}
 
-        prev_byte_collide = collide_row;
+void chip8_reset_registers(CHIP8 *chip8)
+{
+    for (int i = 0; i < NUM_REGISTERS; i++)
+    {
+        chip8->V[i] = 0x00;
     }
 }
 
-void chip8_scroll(CHIP8 *chip8, int xdir, int ydir, int num_pixels, CHIP8BP bitplane)
+void chip8_reset_audio(CHIP8 *chip8)
 {
-    if (bitplane == BPNONE)
+    uint8_t pattern[AUDIO_BUF_SIZE];
+    for (int i = 0; i < AUDIO_BUF_SIZE; i++)
     {
-        return;
+        pattern[i] = (i < 8) ? 0x00 : 0xFF;
     }
 
-    int x_start = 0;
-    int x_end = DISPLAY_WIDTH;
-    int y_start = 0;
-    int y_end = DISPLAY_HEIGHT;
+    chip8_set_audio_pattern(chip8, pattern);
+}
 
-    if (xdir == 1)
-    {
-        x_end = DISPLAY_WIDTH - num_pixels;
-    }
-    else if (xdir == -1)
+void chip8_set_audio_pattern(CHIP8 *chip8, const uint8_t *pattern)
+{
+    /* Copy through a temporary: pattern may overlap the buffer (or be the
+    buffer itself). */
+    uint8_t bytes[AUDIO_BUF_SIZE];
+    memcpy(bytes, pattern, AUDIO_BUF_SIZE);
+
+    chip8_invalidate_code(chip8, AUDIO_BUF_ADDR, AUDIO_BUF_SIZE);
+    memcpy(chip8->RAM + AUDIO_BUF_ADDR, bytes, AUDIO_BUF_SIZE);
+
+    for (int i = 0; i < AUDIO_PATTERN_BITS; i++)
     {
-        x_start = num_pixels;
+        chip8->audio_pattern[i] = (bytes[i / 8] >> (7 - (i % 8))) & 1;
     }
-    if (ydir == 1)
+}
+
+void chip8_load_instr(CHIP8 *chip8, uint16_t instr)
+{
+    chip8->RAM[chip8->pc_start_addr] = instr >> 8;
+    chip8->RAM[chip8->pc_start_addr + 1] = instr & 0x00FF;
+    chip8_invalidate_code(chip8, chip8->pc_start_addr, 2);
+}
+
+void chip8_draw(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n, CHIP8BP bitplane)
+{
+    chip8_draws[chip8->quirk_profile](chip8, x, y, n, bitplane);
+}
+
+// Scrolls one native lores plane in place, filling the vacated pixels with off.
+static void chip8_scroll_lores(uint64_t plane[LORES_HEIGHT], int xdir, int ydir, int num_pixels)
+{
+    if (ydir != 0)
     {
-        y_end = DISPLAY_HEIGHT - num_pixels;
+        int n = (num_pixels < LORES_HEIGHT) ? num_pixels : LORES_HEIGHT;
+        size_t kept = (LORES_HEIGHT - n) * sizeof(plane[0]);
+
+        if (ydir == 1)
+        {
+            memmove(&plane[n], &plane[0], kept);
+            memset(&plane[0], 0, n * sizeof(plane[0]));
+        }
+        else
+        {
+            memmove(&plane[0], &plane[n], kept);
+            memset(&plane[LORES_HEIGHT - n], 0, n * sizeof(plane[0]));
+        }
     }
-    else if (ydir == -1)
+
+    if (xdir != 0)
     {
-        y_start = num_pixels;
+        for (int y = 0; y < LORES_HEIGHT; y++)
+        {
+            if (num_pixels >= LORES_WIDTH)
+            {
+                plane[y] = 0;
+            }
+            else
+            {
+                plane[y] = (xdir == 1) ? plane[y] >> num_pixels : plane[y] << num_pixels;
+            }
+        }
     }
+}
 
-    // Create updated display buffers.
-    uint8_t disp_buf[DISPLAY_HEIGHT][DISPLAY_WIDTH];
-    uint8_t disp_buf2[DISPLAY_HEIGHT][DISPLAY_WIDTH];
-    for (int i = 0; i < DISPLAY_HEIGHT; i++)
+// Scrolls one plane in place, filling the vacated pixels with off.
+static void chip8_scroll_plane(uint64_t plane[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS], int xdir,
+                               int ydir, int num_pixels)
+{
+    if (ydir != 0)
     {
-        for (int j = 0; j < DISPLAY_WIDTH; j++)
+        int n = (num_pixels < DISPLAY_HEIGHT) ? num_pixels : DISPLAY_HEIGHT;
+        size_t kept = (DISPLAY_HEIGHT - n) * sizeof(plane[0]);
+
+        if (ydir == 1)
         {
-            disp_buf[i][j] = false;
-            disp_buf2[i][j] = false;
+            memmove(plane[n], plane[0], kept);
+            memset(plane[0], 0, n * sizeof(plane[0]));
+        }
+        else
+        {
+            memmove(plane[0], plane[n], kept);
+            memset(plane[DISPLAY_HEIGHT - n], 0, n * sizeof(plane[0]));
         }
     }
 
-    for (int y = y_start; y < y_end; y++)
+    if (xdir != 0)
     {
-        for (int x = x_start; x < x_end; x++)
+        /* Shift each row as a 128-bit value. Pixels moving right move towards
+        the least significant bit. */
+        int n = (num_pixels < DISPLAY_WIDTH) ? num_pixels : DISPLAY_WIDTH;
+
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
         {
-            int buf_y = y + (ydir * num_pixels);
-            int buf_x = x + (xdir * num_pixels);
+            uint64_t *row = plane[y];
 
-            disp_buf[buf_y][buf_x] = chip8->display[y][x];
-            disp_buf2[buf_y][buf_x] = chip8->display2[y][x];
+            if (n == DISPLAY_WIDTH)
+            {
+                row[0] = row[1] = 0;
+            }
+            else if (n >= 64)
+            {
+                // Only one word survives, shifted into the other.
+                if (xdir == 1)
+                {
+                    row[1] = row[0] >> (n - 64);
+                    row[0] = 0;
+                }
+                else
+                {
+                    row[0] = row[1] << (n - 64);
+                    row[1] = 0;
+                }
+            }
+            else if (xdir == 1)
+            {
+                row[1] = (row[1] >> n) | (row[0] << (64 - n));
+                row[0] >>= n;
+            }
+            else
+            {
+                row[0] = (row[0] << n) | (row[1] >> (64 - n));
+                row[1] <<= n;
+            }
         }
     }
+}
 
-    // Copy updated display buffer into actual display.
-    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+void chip8_scroll(CHIP8 *chip8, int xdir, int ydir, int num_pixels, CHIP8BP bitplane)
+{
+    if (num_pixels <= 0 || bitplane == BPNONE)
+    {
+        return;
+    }
+
+    // Every row moves or shifts.
+    chip8->dirty_rows = DISPLAY_ALL_ROWS;
+
+    /* Scroll natively by whole lores pixels. Scrolling by half of one (an odd
+    number of display pixels) leaves native lores drawing. */
+    if (chip8->lores_native)
     {
-        for (int x = 0; x < DISPLAY_WIDTH; x++)
+        if (!chip8->hires && !(num_pixels & 1))
         {
             if (bitplane == BP1 || bitplane == BPBOTH)
             {
-                chip8->display[y][x] = disp_buf[y][x];
+                chip8_scroll_lores(chip8->lores, xdir, ydir, num_pixels / 2);
             }
             if (bitplane == BP2 || bitplane == BPBOTH)
             {
-                chip8->display2[y][x] = disp_buf2[y][x];
+                chip8_scroll_lores(chip8->lores2, xdir, ydir, num_pixels / 2);
             }
+
+            chip8->lores_dirty = ~(uint32_t)0;
+            return;
         }
+
+        chip8_leave_lores(chip8);
+    }
+
+    if (bitplane == BP1 || bitplane == BPBOTH)
+    {
+        chip8_scroll_plane(chip8->display, xdir, ydir, num_pixels);
+    }
+    if (bitplane == BP2 || bitplane == BPBOTH)
+    {
+        chip8_scroll_plane(chip8->display2, xdir, ydir, num_pixels);
     }
 }
 
@@ -1149,6 +1435,11 @@ void chip8_wait_key(CHIP8 *chip8, uint8_t x)
     if (!key_released)
     {
         chip8->PC -= 2;
+        chip8->state = STATE_KEY_WAIT;
+    }
+    else
+    {
+        chip8->state = STATE_RUNNING;
     }
 }
 
@@ -1181,6 +1472,8 @@ bool chip8_load_dump(CHIP8 *chip8, char *filename)
 
         fclose(dmp);
 
+        chip8_invalidate_code(chip8, 0, MAX_RAM);
+
         return true;
     }
 
@@ -1239,6 +1532,10 @@ void chip8_skip_instr(CHIP8 *chip8)
 
 double chip8_get_sound_freq(CHIP8 *chip8)
 {
-    // Formula to convert pitch to frequency.
-    return 4000 * pow(2.0, (chip8->pitch - 64.0) / 48.0);
+    return chip8_get_sound_freq_fixed(chip8) / (double)(1 << SOUND_FREQ_FRAC);
+}
+
+uint32_t chip8_get_sound_freq_fixed(const CHIP8 *chip8)
+{
+    return chip8_pitch_freq[chip8->pitch];
 }
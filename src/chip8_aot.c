@@ -0,0 +1,131 @@
+#include <string.h>
+#include "chip8_aot.h"
+
+#ifdef CHIP8_AOT
+
+// Invalidations spanning more RAM than this recheck every block at once.
+#define MAX_INVALIDATE_SCAN 4096
+
+/* Whether a translated block still matches RAM. Blocks are checked against
+the ROM before their first run and again after anything writes RAM they
+span, so self-modified code (or a loaded state) falls back to the
+interpreter until the original code is back. */
+typedef enum
+{
+    AOT_UNVERIFIED,
+    AOT_VALID,
+    AOT_MODIFIED
+} CHIP8AOTSTATE;
+
+// The translated ROM in use and the machine it was loaded into.
+static const CHIP8AOT *aot_program = NULL;
+static CHIP8 *aot_owner = NULL;
+
+// Index + 1 of the block starting at each address (0 for none).
+static uint16_t aot_index[MAX_RAM];
+static uint8_t aot_state[MAX_RAM];
+
+void chip8_aot_load(CHIP8 *chip8)
+{
+    aot_owner = chip8;
+    aot_program = NULL;
+    memset(aot_index, 0, sizeof(aot_index));
+    memset(aot_state, AOT_UNVERIFIED, sizeof(aot_state));
+
+    for (const CHIP8AOT *const *p = chip8_aot_programs; *p != NULL; p++)
+    {
+        if ((*p)->pc_start_addr == chip8->pc_start_addr &&
+            (*p)->rom_size <= (size_t)(MAX_RAM - chip8->pc_start_addr) &&
+            memcmp(chip8->RAM + chip8->pc_start_addr, (*p)->rom, (*p)->rom_size) == 0)
+        {
+            aot_program = *p;
+            break;
+        }
+    }
+
+    if (aot_program == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < aot_program->num_blocks; i++)
+    {
+        aot_index[aot_program->blocks[i].start] = (uint16_t)(i + 1);
+    }
+}
+
+uint32_t chip8_aot_execute(CHIP8 *chip8, uint32_t max_instructions)
+{
+    if (chip8 != aot_owner || aot_program == NULL)
+    {
+        return 0;
+    }
+
+    uint32_t executed = 0;
+    while (executed < max_instructions && !chip8->exit)
+    {
+        uint16_t i = aot_index[chip8->PC];
+        if (i == 0)
+        {
+            break;
+        }
+
+        const CHIP8AOTBLOCK *block = &aot_program->blocks[i - 1];
+        if (block->len > max_instructions - executed)
+        {
+            break;
+        }
+
+        uint8_t *state = &aot_state[chip8->PC];
+        if (*state == AOT_UNVERIFIED)
+        {
+            const uint8_t *rom = aot_program->rom + (block->start - aot_program->pc_start_addr);
+            *state = (memcmp(chip8->RAM + block->start, rom, block->end - block->start) == 0)
+                         ? AOT_VALID
+                         : AOT_MODIFIED;
+        }
+
+        if (*state != AOT_VALID)
+        {
+            break;
+        }
+
+        block->run(chip8);
+        executed += block->len;
+    }
+
+    return executed;
+}
+
+void chip8_aot_invalidate(CHIP8 *chip8, uint16_t addr, size_t len)
+{
+    if (chip8 != aot_owner || aot_program == NULL || len == 0)
+    {
+        return;
+    }
+
+    // Only blocks starting shortly before the range can reach into it.
+    size_t end = addr + len;
+    size_t first = (addr > CHIP8_AOT_MAX_BLOCK_BYTES) ? addr - CHIP8_AOT_MAX_BLOCK_BYTES : 0;
+    if (end - first > MAX_INVALIDATE_SCAN)
+    {
+        memset(aot_state, AOT_UNVERIFIED, sizeof(aot_state));
+        return;
+    }
+
+    for (size_t a = first; a < end && a < MAX_RAM; a++)
+    {
+        uint16_t i = aot_index[a];
+        if (i != 0 && aot_program->blocks[i - 1].end > addr)
+        {
+            aot_state[a] = AOT_UNVERIFIED;
+        }
+    }
+}
+
+#else
+
+// Keeps the translation unit non-empty in builds without translated ROMs.
+typedef int chip8_aot_unused;
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CHIP8_AOT_H
+#define CHIP8_AOT_H
+
+#include <stddef.h>
+#include "chip8.h"
+
+/* Support for ROMs translated ahead of time to C by jaxe-aot (see aot.c).
+Builds that link in a generated unit define CHIP8_AOT. */
+
+// Most instructions in a single translated block.
+#define CHIP8_AOT_MAX_BLOCK_INSTRS 64
+
+// Most bytes of RAM a translated block can span (every instruction F000).
+#define CHIP8_AOT_MAX_BLOCK_BYTES (CHIP8_AOT_MAX_BLOCK_INSTRS * 4)
+
+#ifdef _MSC_VER
+#define CHIP8_AOT_INLINE static __inline
+#else
+#define CHIP8_AOT_INLINE static inline
+#endif
+
+// A basic block translated ahead of time.
+typedef struct
+{
+    // The RAM [start, end) the block was translated from.
+    uint16_t start;
+    uint16_t end;
+
+    // Number of instructions in the block.
+    uint8_t len;
+
+    // Executes every instruction of the block and leaves PC where it ended.
+    void (*run)(CHIP8 *chip8);
+} CHIP8AOTBLOCK;
+
+// A ROM translated ahead of time.
+typedef struct
+{
+    // The ROM the blocks were translated from and where it was loaded.
+    const char *name;
+    uint16_t pc_start_addr;
+    const uint8_t *rom;
+    size_t rom_size;
+
+    // The translated blocks, sorted by address.
+    const CHIP8AOTBLOCK *blocks;
+    size_t num_blocks;
+} CHIP8AOT;
+
+// Every translated ROM of the generated unit, terminated by NULL.
+extern const CHIP8AOT *const chip8_aot_programs[];
+
+#ifdef CHIP8_AOT
+// Picks the translated ROM (if any) matching the ROM just loaded.
+void chip8_aot_load(CHIP8 *chip8);
+
+/* Runs translated blocks starting at PC. Returns the number of instructions
+executed (never more than max_instructions), or 0 if the instruction at PC
+has no valid translation. */
+uint32_t chip8_aot_execute(CHIP8 *chip8, uint32_t max_instructions);
+
+// Marks translated blocks depending on RAM in [addr, addr + len) for rechecking.
+void chip8_aot_invalidate(CHIP8 *chip8, uint16_t addr, size_t len);
+#endif
+
+#endif
@@ -0,0 +1,995 @@
+// MAP_ANONYMOUS is hidden by strict -std=c99 otherwise.
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_dynarec.h"
+
+#ifdef CHIP8_DYNAREC
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+/* A block is a straight run of instructions starting at some PC. It ends at
+a jump (1nnn), before any instruction the recompiler leaves to the
+interpreter (calls, returns, Bnnn, Dxyn, Fx0A, anything that writes RAM or
+touches the disk, ...) or after MAX_BLOCK_INSTRS instructions. Skips become
+conditional exits out of the block, and a block that jumps back to its own
+start keeps looping for as long as the instruction budget allows. */
+#define MAX_BLOCK_INSTRS 32
+
+// Bytes of RAM past its start a block can depend on (see dynarec_compile).
+#define MAX_BLOCK_BYTES (MAX_BLOCK_INSTRS * 2 + 4)
+
+// Highest address an instruction of a block may start at.
+#define MAX_BLOCK_PC (MAX_RAM - 8)
+
+// Size of the executable buffer. Every block is discarded when it fills up.
+#define CODE_BUF_SIZE (4 * 1024 * 1024)
+
+// Generous upper bound on the machine code emitted for a single block.
+#define MAX_BLOCK_CODE (MAX_BLOCK_INSTRS * 192 + 512)
+
+// Invalidations spanning more RAM than this discard every block at once.
+#define MAX_INVALIDATE_SCAN 4096
+
+// x86-64 registers, numbered as in the instruction encoding.
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// x86-64 condition codes.
+enum
+{
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7
+};
+
+/* Register assignment inside a block:
+    -RBX: the machine being run.
+    -RBP: instructions left in the budget.
+    -R15: I.
+    -R8-R14: the most used V registers of the block (the rest are
+     accessed in memory).
+    -RAX, RCX, RDX: scratch. */
+static const int vreg_pool[] = {R12, R13, R14, R8, R9, R10, R11};
+#define NUM_VREGS ((int)(sizeof(vreg_pool) / sizeof(vreg_pool[0])))
+
+#ifdef _WIN32
+#define ARG0 RCX
+#define ARG1 RDX
+#else
+#define ARG0 RDI
+#define ARG1 RSI
+#endif
+
+// How the recompiler handles an instruction.
+typedef enum
+{
+    KIND_STOP,   // Leave it to the interpreter, ending the block before it.
+    KIND_NATIVE, // Translate it to machine code.
+    KIND_SKIP,   // Translate it to a conditional exit out of the block.
+    KIND_CALL,   // Run it through chip8_execute from inside the block.
+    KIND_JUMP    // Translate it and end the block.
+} DYNAREC_KIND;
+
+// A compiled block, indexed by its starting address (which may be odd).
+typedef struct
+{
+    // Where the block's code starts in the code buffer.
+    uint32_t offset;
+
+    // One past the last byte of RAM the block was compiled from.
+    uint16_t end;
+
+    // Instructions executed by one pass through the block (0 = interpret).
+    uint8_t len;
+
+    // Whether the entry has been compiled (or found to be uncompilable).
+    bool compiled;
+} DYNAREC_BLOCK;
+
+typedef struct
+{
+    DYNAREC_BLOCK blocks[MAX_RAM];
+
+    // Executable memory holding the code of every block.
+    uint8_t *code;
+    size_t code_used;
+
+    /* Shared code at the start of the buffer: the entry point called from C
+    and the dispatcher every block exits through (see dynarec_emit_runtime). */
+    uint8_t *enter;
+    uint8_t *dispatch;
+
+    // The machine (and its quirks) the blocks were compiled for.
+    CHIP8 *owner;
+    uint16_t quirks;
+
+    // The range of RAM any compiled block depends on.
+    uint32_t lo, hi;
+} DYNAREC;
+
+// An operand: a host register or [base + disp] in memory.
+typedef struct
+{
+    int reg; // Host register, or -1 for memory.
+    int base;
+    int32_t disp;
+} LOC;
+
+// A jump out of the block that still needs its exit code emitted.
+typedef struct
+{
+    uint8_t *patch;
+    uint16_t pc;
+    uint8_t executed;
+} DYNAREC_EXIT;
+
+typedef struct
+{
+    // Next byte to emit.
+    uint8_t *p;
+
+    // Location of each V register.
+    LOC v[NUM_REGISTERS];
+
+    // Host registers holding V registers, and which V register each holds.
+    int num_cached;
+    int cached_reg[NUM_VREGS];
+    int cached_v[NUM_VREGS];
+
+    // Side exits, emitted after the main path.
+    int num_exits;
+    DYNAREC_EXIT exits[MAX_BLOCK_INSTRS];
+} CODEGEN;
+
+typedef uint32_t (*DYNAREC_FN)(CHIP8 *chip8, uint32_t budget);
+
+static DYNAREC *dynarec = NULL;
+static bool dynarec_unavailable = false;
+
+static LOC loc_reg(int reg)
+{
+    LOC loc = {reg, -1, 0};
+    return loc;
+}
+
+static LOC loc_at(int base, size_t offset)
+{
+    LOC loc = {-1, base, (int32_t)offset};
+    return loc;
+}
+
+// A field of the machine being run.
+static LOC loc_mem(size_t offset)
+{
+    return loc_at(RBX, offset);
+}
+
+static void emit8(CODEGEN *cg, uint8_t b)
+{
+    *cg->p++ = b;
+}
+
+static void emit16(CODEGEN *cg, uint16_t v)
+{
+    emit8(cg, v & 0xFF);
+    emit8(cg, v >> 8);
+}
+
+static void emit32(CODEGEN *cg, uint32_t v)
+{
+    emit16(cg, v & 0xFFFF);
+    emit16(cg, v >> 16);
+}
+
+/* Emits [0x66] [REX] opcode ModRM [disp32], the form shared by nearly every
+instruction used. `size` is the operand size in bytes, `opcode` holds
+`oplen` bytes (most significant first) and `reg` is either a register or an
+opcode extension. Memory operands are always [base + disp32], where base
+can't be RSP or R12 (those would need a SIB byte). */
+static void emit_modrm(CODEGEN *cg, int size, uint32_t opcode, int oplen,
+                       int reg, LOC rm)
+{
+    uint8_t rex = 0x40;
+
+    if (size == 2)
+    {
+        emit8(cg, 0x66);
+    }
+
+    if (size == 8)
+    {
+        rex |= 0x08;
+    }
+
+    if (reg >= 8)
+    {
+        rex |= 0x04;
+    }
+
+    if (rm.reg >= 8 || rm.base >= 8)
+    {
+        rex |= 0x01;
+    }
+
+    // Without a REX prefix byte registers 4-7 would mean AH-BH.
+    bool low_byte = size == 1 && ((reg >= 4 && reg < 8) || (rm.reg >= 4 && rm.reg < 8));
+    if (rex != 0x40 || low_byte)
+    {
+        emit8(cg, rex);
+    }
+
+    for (int i = oplen - 1; i >= 0; i--)
+    {
+        emit8(cg, (opcode >> (i * 8)) & 0xFF);
+    }
+
+    if (rm.reg >= 0)
+    {
+        emit8(cg, 0xC0 | ((reg & 7) << 3) | (rm.reg & 7));
+    }
+    else
+    {
+        emit8(cg, 0x80 | ((reg & 7) << 3) | (rm.base & 7));
+        emit32(cg, (uint32_t)rm.disp);
+    }
+}
+
+static void emit_push(CODEGEN *cg, int reg)
+{
+    if (reg >= 8)
+    {
+        emit8(cg, 0x41);
+    }
+
+    emit8(cg, 0x50 | (reg & 7));
+}
+
+static void emit_pop(CODEGEN *cg, int reg)
+{
+    if (reg >= 8)
+    {
+        emit8(cg, 0x41);
+    }
+
+    emit8(cg, 0x58 | (reg & 7));
+}
+
+// mov r32, imm32
+static void emit_mov_imm32(CODEGEN *cg, int reg, uint32_t imm)
+{
+    if (reg >= 8)
+    {
+        emit8(cg, 0x41);
+    }
+
+    emit8(cg, 0xB8 | (reg & 7));
+    emit32(cg, imm);
+}
+
+// Jumps (or conditionally jumps) to `target`, or returns where to patch it.
+static uint8_t *emit_jump(CODEGEN *cg, int cc, uint8_t *target)
+{
+    if (cc < 0)
+    {
+        emit8(cg, 0xE9);
+    }
+    else
+    {
+        emit8(cg, 0x0F);
+        emit8(cg, 0x80 | cc);
+    }
+
+    uint8_t *patch = cg->p;
+    emit32(cg, target ? (uint32_t)(target - (patch + 4)) : 0);
+    return patch;
+}
+
+static void patch_jump(uint8_t *patch, uint8_t *target)
+{
+    uint32_t rel = (uint32_t)(target - (patch + 4));
+    memcpy(patch, &rel, sizeof(rel));
+}
+
+// Writes every cached V register and I back to the machine.
+static void emit_spill(CODEGEN *cg)
+{
+    for (int i = 0; i < cg->num_cached; i++)
+    {
+        // mov byte [V + n], reg8
+        emit_modrm(cg, 1, 0x88, 1, cg->cached_reg[i],
+                   loc_mem(offsetof(CHIP8, V) + cg->cached_v[i]));
+    }
+
+    // mov word [I], r15w
+    emit_modrm(cg, 2, 0x89, 1, R15, loc_mem(offsetof(CHIP8, I)));
+}
+
+// Reads every cached V register and I from the machine.
+static void emit_reload(CODEGEN *cg)
+{
+    for (int i = 0; i < cg->num_cached; i++)
+    {
+        // movzx reg32, byte [V + n]
+        emit_modrm(cg, 4, 0x0FB6, 2, cg->cached_reg[i],
+                   loc_mem(offsetof(CHIP8, V) + cg->cached_v[i]));
+    }
+
+    // movzx r15d, word [I]
+    emit_modrm(cg, 4, 0x0FB7, 2, R15, loc_mem(offsetof(CHIP8, I)));
+}
+
+/* Leaves the block for pc, charging the instructions executed in this pass
+through it to the budget. */
+static void emit_exit(CODEGEN *cg, uint16_t pc, uint8_t executed)
+{
+    emit_spill(cg);
+
+    // mov word [PC], imm16
+    emit_modrm(cg, 2, 0xC7, 1, 0, loc_mem(offsetof(CHIP8, PC)));
+    emit16(cg, pc);
+
+    if (executed)
+    {
+        // sub ebp, imm32
+        emit_modrm(cg, 4, 0x81, 1, 5, loc_reg(RBP));
+        emit32(cg, executed);
+    }
+
+    emit_jump(cg, -1, dynarec->dispatch);
+}
+
+// Runs the instruction at pc through the interpreter.
+static void emit_interpret(CODEGEN *cg, uint16_t pc)
+{
+    emit_spill(cg);
+
+    // mov word [PC], imm16
+    emit_modrm(cg, 2, 0xC7, 1, 0, loc_mem(offsetof(CHIP8, PC)));
+    emit16(cg, pc);
+
+    // mov arg0, rbx
+    emit_modrm(cg, 8, 0x89, 1, RBX, loc_reg(ARG0));
+
+    // mov rax, imm64; call rax
+    void (*fn)(CHIP8 *) = chip8_execute;
+    uint64_t addr = (uint64_t)(uintptr_t)fn;
+    emit8(cg, 0x48);
+    emit8(cg, 0xB8);
+    emit32(cg, addr & 0xFFFFFFFF);
+    emit32(cg, addr >> 32);
+    emit8(cg, 0xFF);
+    emit8(cg, 0xD0);
+
+    emit_reload(cg);
+}
+
+// dst = src (byte)
+static void emit_load8(CODEGEN *cg, int dst, LOC src)
+{
+    emit_modrm(cg, 1, 0x8A, 1, dst, src);
+}
+
+// dst = src (byte)
+static void emit_store8(CODEGEN *cg, LOC dst, int src)
+{
+    emit_modrm(cg, 1, 0x88, 1, src, dst);
+}
+
+// Sets VF to the given condition of the flags left by the last operation.
+static void emit_setcc_vf(CODEGEN *cg, int cc)
+{
+    emit_modrm(cg, 1, 0x0F90 | cc, 2, 0, cg->v[0xF]);
+}
+
+// Records a conditional exit taken when an instruction at pc skips.
+static void emit_skip_exit(CODEGEN *cg, CHIP8 *chip8, int cc, uint16_t pc,
+                           uint8_t executed)
+{
+    // Mirrors chip8_skip_instr: the 4-byte F000 nnnn is skipped whole.
+    uint16_t next = pc + 2;
+    uint16_t target = (chip8->RAM[next] == 0xF0 && chip8->RAM[next + 1] == 0x00)
+                          ? next + 4
+                          : next + 2;
+
+    DYNAREC_EXIT *exit = &cg->exits[cg->num_exits++];
+    exit->patch = emit_jump(cg, cc, NULL);
+    exit->pc = target;
+    exit->executed = executed;
+}
+
+static DYNAREC_KIND dynarec_classify(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_NONE:
+    case OP_NOP:
+    case OP_LD_BYTE:
+    case OP_ADD_BYTE:
+    case OP_LD_REG:
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+    case OP_ADD_REG:
+    case OP_SUB:
+    case OP_SHR:
+    case OP_SUBN:
+    case OP_SHL:
+    case OP_LD_I:
+    case OP_LD_VX_DT:
+    case OP_LD_DT:
+    case OP_LD_ST:
+    case OP_ADD_I:
+    case OP_LD_F:
+    case OP_LD_HF:
+    case OP_PITCH:
+        return KIND_NATIVE;
+
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+    case OP_SE_REG:
+    case OP_SNE_REG:
+        return KIND_SKIP;
+
+    // Neither of these write RAM nor change the flow of execution.
+    case OP_LOAD_RANGE:
+    case OP_RND:
+    case OP_PLANE:
+    case OP_LD_VX_MEM:
+        return KIND_CALL;
+
+    case OP_JP:
+        return KIND_JUMP;
+
+    /* Everything else, including every instruction chip8_run reports (display
+    changes, HALT, EXIT, Fx0A, Fx75/Fx85). */
+    default:
+        return KIND_STOP;
+    }
+}
+
+// Picks which V registers of a block get a host register.
+static void dynarec_assign_registers(CODEGEN *cg, const CHIP8INSTR *instrs,
+                                     int len)
+{
+    int uses[NUM_REGISTERS] = {0};
+
+    for (int i = 0; i < len; i++)
+    {
+        switch (instrs[i].op)
+        {
+        case OP_LD_REG:
+        case OP_SE_REG:
+        case OP_SNE_REG:
+            uses[instrs[i].y]++;
+            uses[instrs[i].x]++;
+            break;
+
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        case OP_ADD_REG:
+        case OP_SUB:
+        case OP_SHR:
+        case OP_SUBN:
+        case OP_SHL:
+            uses[instrs[i].y]++;
+            uses[instrs[i].x]++;
+            uses[0xF]++;
+            break;
+
+        case OP_LD_BYTE:
+        case OP_ADD_BYTE:
+        case OP_LD_VX_DT:
+        case OP_LD_DT:
+        case OP_LD_ST:
+        case OP_ADD_I:
+        case OP_LD_F:
+        case OP_LD_HF:
+        case OP_PITCH:
+        case OP_SE_BYTE:
+        case OP_SNE_BYTE:
+            uses[instrs[i].x]++;
+            break;
+        }
+    }
+
+    for (int r = 0; r < NUM_REGISTERS; r++)
+    {
+        cg->v[r] = loc_mem(offsetof(CHIP8, V) + r);
+    }
+
+    cg->num_cached = 0;
+    while (cg->num_cached < NUM_VREGS)
+    {
+        int best = -1;
+        for (int r = 0; r < NUM_REGISTERS; r++)
+        {
+            if (uses[r] && (best < 0 || uses[r] > uses[best]))
+            {
+                best = r;
+            }
+        }
+
+        if (best < 0)
+        {
+            break;
+        }
+
+        uses[best] = 0;
+        cg->cached_v[cg->num_cached] = best;
+        cg->cached_reg[cg->num_cached] = vreg_pool[cg->num_cached];
+        cg->v[best] = loc_reg(vreg_pool[cg->num_cached]);
+        cg->num_cached++;
+    }
+}
+
+// Emits the translation of a KIND_NATIVE or KIND_SKIP instruction.
+static void dynarec_emit_instr(CODEGEN *cg, CHIP8 *chip8, CHIP8INSTR in,
+                               uint16_t pc, uint8_t executed)
+{
+    LOC x = cg->v[in.x];
+    LOC y = cg->v[in.y];
+
+    switch (in.op)
+    {
+    case OP_LD_BYTE:
+        // mov Vx, imm8
+        emit_modrm(cg, 1, 0xC6, 1, 0, x);
+        emit8(cg, in.kk);
+        break;
+
+    case OP_ADD_BYTE:
+        // add Vx, imm8
+        emit_modrm(cg, 1, 0x80, 1, 0, x);
+        emit8(cg, in.kk);
+        break;
+
+    case OP_LD_REG:
+        if (in.x != in.y)
+        {
+            emit_load8(cg, RAX, y);
+            emit_store8(cg, x, RAX);
+        }
+        break;
+
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+        // or/and/xor Vx, al
+        emit_load8(cg, RAX, y);
+        emit_modrm(cg, 1, in.op == OP_OR ? 0x08 : in.op == OP_AND ? 0x20 : 0x30,
+                   1, RAX, x);
+
+        if (!(chip8->quirks & QUIRK(9)))
+        {
+            emit_modrm(cg, 1, 0xC6, 1, 0, cg->v[0xF]);
+            emit8(cg, 0);
+        }
+        break;
+
+    case OP_ADD_REG:
+        // add al, Vy
+        emit_load8(cg, RAX, x);
+        emit_modrm(cg, 1, 0x02, 1, RAX, y);
+        emit_store8(cg, x, RAX);
+        emit_setcc_vf(cg, CC_B);
+        break;
+
+    case OP_SUB:
+    case OP_SUBN:
+        // sub al, Vy (or Vx)
+        emit_load8(cg, RAX, in.op == OP_SUB ? x : y);
+        emit_modrm(cg, 1, 0x2A, 1, RAX, in.op == OP_SUB ? y : x);
+        emit_store8(cg, x, RAX);
+        emit_setcc_vf(cg, CC_AE);
+        break;
+
+    case OP_SHR:
+    case OP_SHL:
+        // shr/shl al, 1
+        emit_load8(cg, RAX, (chip8->quirks & QUIRK(1)) ? x : y);
+        emit_modrm(cg, 1, 0xD0, 1, in.op == OP_SHR ? 5 : 4, loc_reg(RAX));
+        emit_store8(cg, x, RAX);
+        emit_setcc_vf(cg, CC_B);
+        break;
+
+    case OP_LD_I:
+        emit_mov_imm32(cg, R15, in.nnn);
+        break;
+
+    case OP_ADD_I:
+        // movzx eax, Vx; add r15d, eax; movzx r15d, r15w
+        emit_modrm(cg, 4, 0x0FB6, 2, RAX, x);
+        emit_modrm(cg, 4, 0x01, 1, RAX, loc_reg(R15));
+        emit_modrm(cg, 4, 0x0FB7, 2, R15, loc_reg(R15));
+        break;
+
+    case OP_LD_F:
+    case OP_LD_HF:
+        // movzx eax, Vx; imul r15d, eax, 5 (or 10)
+        emit_modrm(cg, 4, 0x0FB6, 2, RAX, x);
+        emit_modrm(cg, 4, 0x6B, 1, R15, loc_reg(RAX));
+        emit8(cg, in.op == OP_LD_F ? 0x05 : 0x0A);
+
+        // add r15d, imm8
+        emit_modrm(cg, 4, 0x83, 1, 0, loc_reg(R15));
+        emit8(cg, in.op == OP_LD_F ? FONT_START_ADDR : BIG_FONT_START_ADDR);
+        break;
+
+    case OP_LD_VX_DT:
+        emit_load8(cg, RAX, loc_mem(offsetof(CHIP8, DT)));
+        emit_store8(cg, x, RAX);
+        break;
+
+    case OP_LD_DT:
+        emit_load8(cg, RAX, x);
+        emit_store8(cg, loc_mem(offsetof(CHIP8, DT)), RAX);
+        break;
+
+    case OP_LD_ST:
+        emit_load8(cg, RAX, x);
+        emit_store8(cg, loc_mem(offsetof(CHIP8, ST)), RAX);
+        break;
+
+    case OP_PITCH:
+        emit_load8(cg, RAX, x);
+        emit_store8(cg, loc_mem(offsetof(CHIP8, pitch)), RAX);
+        break;
+
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+        // cmp Vx, imm8
+        emit_modrm(cg, 1, 0x80, 1, 7, x);
+        emit8(cg, in.kk);
+        emit_skip_exit(cg, chip8, in.op == OP_SE_BYTE ? CC_E : CC_NE, pc,
+                       executed);
+        break;
+
+    case OP_SE_REG:
+    case OP_SNE_REG:
+        // cmp al, Vy
+        emit_load8(cg, RAX, x);
+        emit_modrm(cg, 1, 0x3A, 1, RAX, y);
+        emit_skip_exit(cg, chip8, in.op == OP_SE_REG ? CC_E : CC_NE, pc,
+                       executed);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Emits the code shared by every block:
+    -enter(chip8, budget): Saves the callee-saved registers, keeping the stack
+     16-byte aligned (with Win64 shadow space) for calls into the
+     interpreter, then falls into dispatch.
+    -dispatch: Jumps to the block at PC if it's compiled and fits in the
+     budget, otherwise returns the remaining budget to C. Chaining blocks
+     this way keeps hot loops out of C entirely. */
+static void dynarec_emit_runtime(void)
+{
+    CODEGEN cg;
+    cg.p = dynarec->code;
+    cg.num_cached = 0;
+
+    dynarec->enter = cg.p;
+    emit_push(&cg, RBX);
+    emit_push(&cg, RBP);
+    emit_push(&cg, R12);
+    emit_push(&cg, R13);
+    emit_push(&cg, R14);
+    emit_push(&cg, R15);
+    emit_modrm(&cg, 8, 0x83, 1, 5, loc_reg(RSP));
+    emit8(&cg, 40);
+    emit_modrm(&cg, 8, 0x89, 1, ARG0, loc_reg(RBX));
+    emit_modrm(&cg, 4, 0x89, 1, ARG1, loc_reg(RBP));
+
+    dynarec->dispatch = cg.p;
+
+    // movzx eax, word [PC]
+    emit_modrm(&cg, 4, 0x0FB7, 2, RAX, loc_mem(offsetof(CHIP8, PC)));
+
+    // cmp eax, MAX_BLOCK_PC; ja leave
+    emit_modrm(&cg, 4, 0x81, 1, 7, loc_reg(RAX));
+    emit32(&cg, MAX_BLOCK_PC);
+    uint8_t *high = emit_jump(&cg, CC_A, NULL);
+
+    // rdx = &blocks[eax]
+    emit_modrm(&cg, 4, 0x6B, 1, RAX, loc_reg(RAX));
+    emit8(&cg, sizeof(DYNAREC_BLOCK));
+    uint64_t blocks = (uint64_t)(uintptr_t)dynarec->blocks;
+    emit8(&cg, 0x48);
+    emit8(&cg, 0xBA);
+    emit32(&cg, blocks & 0xFFFFFFFF);
+    emit32(&cg, blocks >> 32);
+    emit_modrm(&cg, 8, 0x01, 1, RAX, loc_reg(RDX));
+
+    // cmp byte [compiled], 0; je leave
+    emit_modrm(&cg, 1, 0x80, 1, 7, loc_at(RDX, offsetof(DYNAREC_BLOCK, compiled)));
+    emit8(&cg, 0);
+    uint8_t *uncompiled = emit_jump(&cg, CC_E, NULL);
+
+    // movzx ecx, byte [len]; test ecx, ecx; jz leave; cmp ebp, ecx; jb leave
+    emit_modrm(&cg, 4, 0x0FB6, 2, RCX, loc_at(RDX, offsetof(DYNAREC_BLOCK, len)));
+    emit_modrm(&cg, 4, 0x85, 1, RCX, loc_reg(RCX));
+    uint8_t *interpret = emit_jump(&cg, CC_E, NULL);
+    emit_modrm(&cg, 4, 0x39, 1, RCX, loc_reg(RBP));
+    uint8_t *budget = emit_jump(&cg, CC_B, NULL);
+
+    // mov eax, [offset]; mov rcx, code; add rax, rcx; jmp rax
+    emit_modrm(&cg, 4, 0x8B, 1, RAX, loc_at(RDX, offsetof(DYNAREC_BLOCK, offset)));
+    uint64_t code = (uint64_t)(uintptr_t)dynarec->code;
+    emit8(&cg, 0x48);
+    emit8(&cg, 0xB9);
+    emit32(&cg, code & 0xFFFFFFFF);
+    emit32(&cg, code >> 32);
+    emit_modrm(&cg, 8, 0x01, 1, RCX, loc_reg(RAX));
+    emit8(&cg, 0xFF);
+    emit8(&cg, 0xE0);
+
+    // leave: Return the remaining budget.
+    patch_jump(high, cg.p);
+    patch_jump(uncompiled, cg.p);
+    patch_jump(interpret, cg.p);
+    patch_jump(budget, cg.p);
+    emit_modrm(&cg, 4, 0x89, 1, RBP, loc_reg(RAX));
+    emit_modrm(&cg, 8, 0x83, 1, 0, loc_reg(RSP));
+    emit8(&cg, 40);
+    emit_pop(&cg, R15);
+    emit_pop(&cg, R14);
+    emit_pop(&cg, R13);
+    emit_pop(&cg, R12);
+    emit_pop(&cg, RBP);
+    emit_pop(&cg, RBX);
+    emit8(&cg, 0xC3);
+
+    dynarec->code_used = cg.p - dynarec->code;
+}
+
+// Discards every block and all generated code.
+static void dynarec_flush(void)
+{
+    memset(dynarec->blocks, 0, sizeof(dynarec->blocks));
+    dynarec->lo = MAX_RAM;
+    dynarec->hi = 0;
+    dynarec_emit_runtime();
+}
+
+static void dynarec_compile(CHIP8 *chip8, uint16_t start, DYNAREC_BLOCK *block)
+{
+    if (CODE_BUF_SIZE - dynarec->code_used < MAX_BLOCK_CODE)
+    {
+        dynarec_flush();
+    }
+
+    // Gather the instructions of the block.
+    CHIP8INSTR instrs[MAX_BLOCK_INSTRS];
+    int len = 0;
+    uint32_t pc = start;
+    uint32_t end = start + 2;
+
+    while (len < MAX_BLOCK_INSTRS && pc <= MAX_BLOCK_PC)
+    {
+        CHIP8INSTR in;
+        chip8_decode(&in, chip8->RAM[pc], chip8->RAM[pc + 1]);
+
+        /* Idle loops are left to chip8_run, which skips them once the
+        interpreter has run their first instruction. */
+        DYNAREC_KIND kind = dynarec_classify(in.op);
+        if (kind == KIND_STOP || chip8_is_idle_loop(chip8->RAM, pc))
+        {
+            break;
+        }
+
+        instrs[len++] = in;
+        pc += 2;
+
+        // A skip also depends on whether the next instruction is F000.
+        end = (kind == KIND_SKIP) ? pc + 2 : pc;
+        if (kind == KIND_JUMP)
+        {
+            break;
+        }
+    }
+
+    block->compiled = true;
+    block->len = len;
+    block->end = end;
+
+    if (start < dynarec->lo)
+    {
+        dynarec->lo = start;
+    }
+
+    if (end > dynarec->hi)
+    {
+        dynarec->hi = end;
+    }
+
+    if (len == 0)
+    {
+        return;
+    }
+
+    CODEGEN cg;
+    cg.p = dynarec->code + dynarec->code_used;
+    cg.num_exits = 0;
+    dynarec_assign_registers(&cg, instrs, len);
+
+    block->offset = dynarec->code_used;
+    emit_reload(&cg);
+
+    uint8_t *top = cg.p;
+    uint16_t target;
+    pc = start;
+    for (int i = 0; i < len; i++, pc += 2)
+    {
+        switch (dynarec_classify(instrs[i].op))
+        {
+        case KIND_CALL:
+            emit_interpret(&cg, pc);
+            break;
+
+        case KIND_JUMP:
+            target = instrs[i].nnn;
+            if (target == start)
+            {
+                // sub ebp, len; cmp ebp, len; jae top
+                emit_modrm(&cg, 4, 0x81, 1, 5, loc_reg(RBP));
+                emit32(&cg, len);
+                emit_modrm(&cg, 4, 0x81, 1, 7, loc_reg(RBP));
+                emit32(&cg, len);
+                emit_jump(&cg, CC_AE, top);
+                emit_exit(&cg, start, 0);
+            }
+            else
+            {
+                emit_exit(&cg, target, len);
+            }
+            break;
+
+        default:
+            dynarec_emit_instr(&cg, chip8, instrs[i], pc, i + 1);
+            break;
+        }
+    }
+
+    if (dynarec_classify(instrs[len - 1].op) != KIND_JUMP)
+    {
+        emit_exit(&cg, pc, len);
+    }
+
+    for (int i = 0; i < cg.num_exits; i++)
+    {
+        patch_jump(cg.exits[i].patch, cg.p);
+        emit_exit(&cg, cg.exits[i].pc, cg.exits[i].executed);
+    }
+
+    dynarec->code_used = cg.p - dynarec->code;
+}
+
+/* Allocates the recompiler on first use and discards blocks compiled for a
+different machine or set of quirks. */
+static bool dynarec_prepare(CHIP8 *chip8)
+{
+    if (dynarec == NULL)
+    {
+        if (dynarec_unavailable)
+        {
+            return false;
+        }
+
+        dynarec = calloc(1, sizeof(DYNAREC));
+        if (dynarec != NULL)
+        {
+#ifdef _WIN32
+            dynarec->code = VirtualAlloc(NULL, CODE_BUF_SIZE, MEM_COMMIT | MEM_RESERVE,
+                                         PAGE_EXECUTE_READWRITE);
+#else
+            dynarec->code = mmap(NULL, CODE_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (dynarec->code == MAP_FAILED)
+            {
+                dynarec->code = NULL;
+            }
+#endif
+        }
+
+        // Hosts that refuse executable memory just keep interpreting.
+        if (dynarec == NULL || dynarec->code == NULL)
+        {
+            free(dynarec);
+            dynarec = NULL;
+            dynarec_unavailable = true;
+            return false;
+        }
+
+        dynarec_flush();
+    }
+
+    if (dynarec->owner != chip8 ||
+        dynarec->quirks != chip8->quirks)
+    {
+        dynarec_flush();
+        dynarec->owner = chip8;
+        dynarec->quirks = chip8->quirks;
+    }
+
+    return true;
+}
+
+uint32_t chip8_dynarec_execute(CHIP8 *chip8, uint32_t max_instructions)
+{
+    uint16_t pc = chip8->PC;
+    if (pc > MAX_BLOCK_PC || !dynarec_prepare(chip8))
+    {
+        return 0;
+    }
+
+    DYNAREC_BLOCK *block = &dynarec->blocks[pc];
+    if (!block->compiled)
+    {
+        dynarec_compile(chip8, pc, block);
+    }
+
+    if (block->len == 0 || block->len > max_instructions)
+    {
+        return 0;
+    }
+
+    DYNAREC_FN enter = (DYNAREC_FN)(uintptr_t)dynarec->enter;
+    return max_instructions - enter(chip8, max_instructions);
+}
+
+void chip8_dynarec_invalidate(CHIP8 *chip8, uint16_t addr, size_t len)
+{
+    if (dynarec == NULL || chip8 != dynarec->owner || len == 0)
+    {
+        return;
+    }
+
+    size_t end = addr + len;
+    if (end <= dynarec->lo || addr >= dynarec->hi)
+    {
+        return;
+    }
+
+    // Only blocks starting shortly before the range can reach into it.
+    size_t first = (addr > MAX_BLOCK_BYTES) ? addr - MAX_BLOCK_BYTES : 0;
+    if (end - first > MAX_INVALIDATE_SCAN)
+    {
+        dynarec_flush();
+        return;
+    }
+
+    for (size_t a = first; a < end && a < MAX_RAM; a++)
+    {
+        DYNAREC_BLOCK *block = &dynarec->blocks[a];
+        if (block->compiled && block->end > addr)
+        {
+            block->compiled = false;
+        }
+    }
+}
+
+#else
+
+// Keeps the translation unit non-empty on hosts without a recompiler.
+typedef int chip8_dynarec_unused;
+
+#endif
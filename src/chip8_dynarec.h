@@ -0,0 +1,24 @@
+#ifndef CHIP8_DYNAREC_H
+#define CHIP8_DYNAREC_H
+
+#include <stddef.h>
+#include "chip8.h"
+
+/* The dynamic recompiler only targets x86-64. On every other host (or when
+built with CHIP8_NO_DYNAREC) the interpreter executes every instruction. */
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(CHIP8_NO_DYNAREC)
+#define CHIP8_DYNAREC
+#endif
+
+#ifdef CHIP8_DYNAREC
+/* Runs the compiled block starting at PC, compiling it first if needed.
+Returns the number of instructions executed (never more than
+max_instructions), or 0 if the interpreter must execute the next
+instruction instead. */
+uint32_t chip8_dynarec_execute(CHIP8 *chip8, uint32_t max_instructions);
+
+// Discards every compiled block that depends on RAM in [addr, addr + len).
+void chip8_dynarec_invalidate(CHIP8 *chip8, uint16_t addr, size_t len);
+#endif
+
+#endif
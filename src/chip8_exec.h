@@ -0,0 +1,272 @@
+/* Executor and sprite routine, instantiated once per quirk profile in chip8.c.
+
+This file is meant to be included multiple times. Before including it define
+CHIP8_EXEC_SUFFIX (appended to every function name) and, for a specialized
+instance, CHIP8_EXEC_QUIRKS as the constant quirks mask it is built for. Without
+CHIP8_EXEC_QUIRKS the instance reads the machine's quirks at runtime and works
+for any combination. Both macros are undefined again at the end. */
+
+#define CHIP8_EXEC_CAT2(a, b) a##_##b
+#define CHIP8_EXEC_CAT(a, b) CHIP8_EXEC_CAT2(a, b)
+#define CHIP8_EXEC(name) CHIP8_EXEC_CAT(name, CHIP8_EXEC_SUFFIX)
+
+#ifdef CHIP8_EXEC_QUIRKS
+#define CHIP8_QUIRK(n) ((CHIP8_EXEC_QUIRKS & QUIRK(n)) != 0)
+#else
+#define CHIP8_QUIRK(n) ((chip8->quirks & QUIRK(n)) != 0)
+#endif
+
+#define CHIP8_DRAW CHIP8_EXEC(chip8_draw)
+
+// Draws a lores sprite at native resolution (see lores_native).
+static void CHIP8_EXEC(chip8_draw_lores)(CHIP8 *chip8, uint8_t x, uint8_t y, int n, int rows,
+                                         CHIP8BP bitplane)
+{
+    bool wide = (n == 32);
+    int sprite_rows = wide ? 16 : n;
+
+    // Out-of-bound sprites either wrap around or get clipped.
+    unsigned col = x;
+    if (!CHIP8_QUIRK(6))
+    {
+        col %= LORES_WIDTH;
+    }
+    else if (col >= LORES_WIDTH)
+    {
+        return;
+    }
+
+    for (int r = 0; r < sprite_rows; r++)
+    {
+        int i = wide ? (r * 2) : r;
+
+        unsigned lores_y = y + r;
+        if (!CHIP8_QUIRK(6))
+        {
+            lores_y %= LORES_HEIGHT;
+        }
+        else if (lores_y >= LORES_HEIGHT)
+        {
+            break;
+        }
+
+        chip8->lores_dirty |= (uint32_t)1 << lores_y;
+        chip8->dirty_rows |= (uint64_t)3 << (lores_y * 2);
+
+        // XOR the row onto the plane(s), noting any erased pixel.
+        uint64_t mask = chip8_lores_mask(chip8->RAM + chip8->I + i, wide, col, !CHIP8_QUIRK(6));
+        uint64_t *row = (bitplane == BP2) ? &chip8->lores2[lores_y] : &chip8->lores[lores_y];
+        bool collide = (*row & mask) != 0;
+        *row ^= mask;
+
+        if (bitplane == BPBOTH)
+        {
+            mask = chip8_lores_mask(chip8->RAM + chip8->I + rows + i, wide, col,
+                                    !CHIP8_QUIRK(6));
+            collide |= (chip8->lores2[lores_y] & mask) != 0;
+            chip8->lores2[lores_y] ^= mask;
+        }
+
+        if (collide)
+        {
+            chip8->V[0x0F] = 1;
+        }
+    }
+}
+
+static void CHIP8_EXEC(chip8_draw)(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n,
+                                   CHIP8BP bitplane)
+{
+    if (bitplane == BPNONE)
+    {
+        return;
+    }
+
+    chip8->V[0x0F] = 0;
+    int rows;
+
+    /* n==0 only has signifigance in S-CHIP mode,
+    otherwise nothing should be drawn. */
+    if (n == 0)
+    {
+        /* Draw a 32-byte (16x16) sprite in hires or
+        a 16-byte (8x16) sprite in lores. */
+        n = (chip8->hires || !CHIP8_QUIRK(4)) ? 32 : 16;
+    }
+
+    if (chip8->hires && CHIP8_QUIRK(8))
+    {
+        rows = (n == 32) ? 16 : n;
+        chip8->V[0x0F] += ((y + rows) - (DISPLAY_HEIGHT - 1));
+    }
+    else
+    {
+        rows = n;
+    }
+
+    if (chip8->lores_native)
+    {
+        if (!chip8->hires)
+        {
+            CHIP8_EXEC(chip8_draw_lores)(chip8, x, y, n, rows, bitplane);
+            return;
+        }
+
+        chip8_leave_lores(chip8);
+    }
+
+    /* Big sprites are 16 pixels (two bytes) wide. In lores every pixel is
+    drawn as 2x2 display pixels. */
+    bool wide = (n == 32);
+    int sprite_rows = wide ? 16 : n;
+    int scale = chip8->hires ? 1 : 2;
+
+    // Out-of-bound sprites either wrap around or get clipped.
+    unsigned col = x * scale;
+    if (!CHIP8_QUIRK(6))
+    {
+        col %= DISPLAY_WIDTH;
+    }
+    else if (col >= DISPLAY_WIDTH)
+    {
+        return;
+    }
+
+    for (int r = 0; r < sprite_rows; r++)
+    {
+        int i = wide ? (r * 2) : r;
+
+        /* The masks of the sprite row for the first selected plane and, when
+        drawing to both, for the second plane (whose data follows the first). */
+        uint64_t mask[2], mask2[2];
+        chip8_sprite_mask(chip8->RAM + chip8->I + i, wide, scale, col,
+                          !CHIP8_QUIRK(6), mask);
+        if (bitplane == BPBOTH)
+        {
+            chip8_sprite_mask(chip8->RAM + chip8->I + rows + i, wide, scale, col,
+                              !CHIP8_QUIRK(6), mask2);
+        }
+
+        bool collide = false;
+        for (int h = 0; h < scale; h++)
+        {
+            unsigned disp_y = (y * scale) + (r * scale) + h;
+            if (!CHIP8_QUIRK(6))
+            {
+                disp_y %= DISPLAY_HEIGHT;
+            }
+            else if (disp_y >= DISPLAY_HEIGHT)
+            {
+                break;
+            }
+
+            chip8->dirty_rows |= (uint64_t)1 << disp_y;
+
+            /* XOR the row onto the display. If a pixel is erased, there was a
+            collision. */
+            uint64_t *row = (bitplane == BP2) ? chip8->display2[disp_y]
+                                              : chip8->display[disp_y];
+            collide |= ((row[0] & mask[0]) | (row[1] & mask[1])) != 0;
+            row[0] ^= mask[0];
+            row[1] ^= mask[1];
+
+            if (bitplane == BPBOTH)
+            {
+                row = chip8->display2[disp_y];
+                collide |= ((row[0] & mask2[0]) | (row[1] & mask2[1])) != 0;
+                row[0] ^= mask2[0];
+                row[1] ^= mask2[1];
+            }
+        }
+
+        if (collide)
+        {
+            // Count the rows with a collision or just set VF.
+            if (chip8->hires && CHIP8_QUIRK(7))
+            {
+                chip8->V[0x0F]++;
+            }
+            else
+            {
+                chip8->V[0x0F] = 1;
+            }
+        }
+    }
+}
+
+#ifdef CHIP8_DISPATCH_TABLE
+#define CHIP8_OP(name, ...)                                             \
+    static void CHIP8_EXEC(chip8_op_##name)(CHIP8 *chip8, CHIP8INSTR in) \
+    {                                                                   \
+        (void)chip8;                                                    \
+        (void)in;                                                       \
+        __VA_ARGS__                                                     \
+    }
+#include "chip8_ops.h"
+#undef CHIP8_OP
+
+// Handler for each operation, indexed by CHIP8OP.
+static void (*const CHIP8_EXEC(chip8_handlers)[NUM_OPS])(CHIP8 *chip8, CHIP8INSTR in) = {
+#define CHIP8_OP(name, ...) [OP_##name] = CHIP8_EXEC(chip8_op_##name),
+#include "chip8_ops.h"
+#undef CHIP8_OP
+};
+#endif
+
+/* Executes the instruction at PC and returns its operation. Released keys are
+left for the caller to reset. */
+static uint8_t CHIP8_EXEC(chip8_execute)(CHIP8 *chip8)
+{
+    /* Fetch and decode */
+    CHIP8INSTR in;
+    chip8_fetch(chip8, &in);
+
+    /* Immediately set PC to next instruction
+    after fetching and decoding the current one. */
+    chip8->PC += 2;
+
+    /* Execute */
+#if defined(CHIP8_DISPATCH_GOTO)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static const void *const labels[NUM_OPS] = {
+#define CHIP8_OP(name, ...) [OP_##name] = &&op_##name,
+#include "chip8_ops.h"
+#undef CHIP8_OP
+    };
+
+    goto *labels[in.op];
+
+#define CHIP8_OP(name, ...) \
+    op_##name : { __VA_ARGS__ } goto executed;
+#include "chip8_ops.h"
+#undef CHIP8_OP
+#pragma GCC diagnostic pop
+
+executed:
+#elif defined(CHIP8_DISPATCH_TABLE)
+    CHIP8_EXEC(chip8_handlers)[in.op](chip8, in);
+#else
+    switch (in.op)
+    {
+#define CHIP8_OP(name, ...) \
+    case OP_##name:         \
+    {                       \
+        __VA_ARGS__         \
+    }                       \
+    break;
+#include "chip8_ops.h"
+#undef CHIP8_OP
+    }
+#endif
+
+    return in.op;
+}
+
+#undef CHIP8_DRAW
+#undef CHIP8_QUIRK
+#undef CHIP8_EXEC
+#undef CHIP8_EXEC_CAT
+#undef CHIP8_EXEC_CAT2
+#undef CHIP8_EXEC_QUIRKS
+#undef CHIP8_EXEC_SUFFIX
@@ -0,0 +1,469 @@
+/* Instruction semantics shared by every execution engine in chip8.c.
+
+This file is meant to be included multiple times. Before including it define
+CHIP8_OP(name, ...) to expand each operation into whatever the engine needs
+(a switch case, a handler function, a computed-goto label, ...). Bodies may
+use `chip8` (the machine), `in` (the decoded CHIP8INSTR), CHIP8_QUIRK(n) and
+CHIP8_DRAW (the sprite routine to call, taking chip8_draw's arguments).
+PC has already been advanced past the instruction when a body runs. */
+
+/* Undecoded entry or unknown instruction:
+   Do nothing. */
+CHIP8_OP(NONE,
+    ;
+)
+
+CHIP8_OP(NOP,
+    ;
+)
+
+/* HALT (0000)
+   Halt the emulator. */
+CHIP8_OP(HALT,
+    chip8->PC -= 2;
+    chip8->state = STATE_HALTED;
+)
+
+/* CLS (00E0)
+   Clear the display. */
+CHIP8_OP(CLS,
+    chip8_reset_display(chip8, chip8->bitplane);
+)
+
+/* RET (00EE):
+   Return from a subroutine. */
+CHIP8_OP(RET,
+    chip8->PC = (chip8->RAM[chip8->SP] << 8);
+    chip8->PC |= chip8->RAM[chip8->SP + 1];
+    chip8->SP -= 2;
+)
+
+/* SCRR (00FB) (S-CHIP Only):
+   Scroll the display right by 4 pixels. */
+CHIP8_OP(SCRR,
+    chip8_scroll(chip8, 1, 0, 4, chip8->bitplane);
+)
+
+/* SCRL (00FC) (S-CHIP Only):
+   Scroll the display left by 4 pixels. */
+CHIP8_OP(SCRL,
+    chip8_scroll(chip8, -1, 0, 4, chip8->bitplane);
+)
+
+/* EXIT (00FD) (S-CHIP Only):
+   Exit the interpreter. */
+CHIP8_OP(EXIT,
+    chip8->exit = true;
+)
+
+/* LORES (00FE) (S-CHIP Only):
+   Disable HI-RES mode. */
+CHIP8_OP(LORES,
+    chip8_set_hires(chip8, false);
+
+    if (!CHIP8_QUIRK(5))
+    {
+        chip8_reset_display(chip8, chip8->bitplane);
+    }
+)
+
+/* HIRES (00FF) (S-CHIP Only):
+   Enable HI-RES mode. */
+CHIP8_OP(HIRES,
+    chip8_set_hires(chip8, true);
+
+    if (!CHIP8_QUIRK(5))
+    {
+        chip8_reset_display(chip8, chip8->bitplane);
+    }
+)
+
+/* SCRD (00Cn) (S-CHIP Only):
+   Scroll the display down by n pixels. */
+CHIP8_OP(SCRD,
+    chip8_scroll(chip8, 0, 1, in.n, chip8->bitplane);
+)
+
+/* SCRU (00Dn) (S-CHIP Only):
+   Scroll the display up by n pixels. */
+CHIP8_OP(SCRU,
+    chip8_scroll(chip8, 0, -1, in.n, chip8->bitplane);
+)
+
+/* JP addr (1nnn)
+   Jump to location nnn. */
+CHIP8_OP(JP,
+    chip8->PC = in.nnn;
+)
+
+/* CALL addr (2nnn)
+   Call subroutine at nnn. */
+CHIP8_OP(CALL,
+    chip8->SP += 2;
+    chip8_invalidate_code(chip8, chip8->SP, 2);
+    chip8->RAM[chip8->SP] = chip8->PC >> 8;
+    chip8->RAM[chip8->SP + 1] = chip8->PC & 0x00FF;
+    chip8->PC = in.nnn;
+)
+
+/* SE Vx, byte (3xkk)
+   Skip next instruction if Vx = kk. */
+CHIP8_OP(SE_BYTE,
+    if (chip8->V[in.x] == in.kk)
+    {
+        chip8_skip_instr(chip8);
+    }
+)
+
+/* SNE Vx, byte (4xkk)
+   Skip next instruction if Vx != kk. */
+CHIP8_OP(SNE_BYTE,
+    if (chip8->V[in.x] != in.kk)
+    {
+        chip8_skip_instr(chip8);
+    }
+)
+
+/* SE Vx, Vy (5xy0)
+   Skip next instruction if Vx = Vy. */
+CHIP8_OP(SE_REG,
+    if (chip8->V[in.x] == chip8->V[in.y])
+    {
+        chip8_skip_instr(chip8);
+    }
+)
+
+/* LD [I], Vx - Vy (5xy2) (XO-CHIP Only)
+   Store registers Vx through Vy in memory starting at location I. */
+CHIP8_OP(SAVE_RANGE,
+    if (in.y >= in.x)
+    {
+        chip8_invalidate_code(chip8, chip8->I, in.y - in.x + 1);
+        for (int r = 0; r <= (in.y - in.x); r++)
+        {
+            chip8->RAM[chip8->I + r] = chip8->V[in.x + r];
+        }
+    }
+    else
+    {
+        chip8_invalidate_code(chip8, chip8->I, in.x - in.y + 1);
+        for (int r = 0; r <= (in.x - in.y); r++)
+        {
+            chip8->RAM[chip8->I + r] = chip8->V[in.x - r];
+        }
+    }
+)
+
+/* LD Vx - Vy, [I] (5xy3) (XO-CHIP Only)
+   Read registers Vx through Vy from memory starting at location I. */
+CHIP8_OP(LOAD_RANGE,
+    if (in.y >= in.x)
+    {
+        for (int r = 0; r <= (in.y - in.x); r++)
+        {
+            chip8->V[in.x + r] = chip8->RAM[chip8->I + r];
+        }
+    }
+    else
+    {
+        for (int r = 0; r <= (in.x - in.y); r++)
+        {
+            chip8->V[in.x - r] = chip8->RAM[chip8->I + r];
+        }
+    }
+)
+
+/* LD Vx, byte (6xkk)
+   Set Vx = kk. */
+CHIP8_OP(LD_BYTE,
+    chip8->V[in.x] = in.kk;
+)
+
+/* ADD Vx, byte (7xkk)
+   Set Vx = Vx + kk. */
+CHIP8_OP(ADD_BYTE,
+    chip8->V[in.x] += in.kk;
+)
+
+/* LD Vx, Vy (8xy0)
+   Set Vx = Vy. */
+CHIP8_OP(LD_REG,
+    chip8->V[in.x] = chip8->V[in.y];
+)
+
+/* OR Vx, Vy (8xy1)
+   Set Vx = Vx OR Vy.
+   Legacy: Set VF = 0.
+   S-CHIP: Leave VF alone. */
+CHIP8_OP(OR,
+    chip8->V[in.x] |= chip8->V[in.y];
+
+    if (!CHIP8_QUIRK(9))
+    {
+        chip8->V[0x0F] = 0;
+    }
+)
+
+/* AND Vx, Vy (8xy2)
+   Set Vx = Vx AND Vy.
+   Legacy: Set VF = 0.
+   S-CHIP: Leave VF alone. */
+CHIP8_OP(AND,
+    chip8->V[in.x] &= chip8->V[in.y];
+
+    if (!CHIP8_QUIRK(9))
+    {
+        chip8->V[0x0F] = 0;
+    }
+)
+
+/* XOR Vx, Vy (8xy3)
+   Set Vx = Vx XOR Vy.
+   Legacy: Set VF = 0.
+   S-CHIP: Leave VF alone. */
+CHIP8_OP(XOR,
+    chip8->V[in.x] ^= chip8->V[in.y];
+
+    if (!CHIP8_QUIRK(9))
+    {
+        chip8->V[0x0F] = 0;
+    }
+)
+
+/* ADD Vx, Vy (8xy4)
+   Set Vx = Vx + Vy, set VF = carry. */
+CHIP8_OP(ADD_REG,
+    bool carry = ((chip8->V[in.x] + chip8->V[in.y]) > 0xFF);
+    chip8->V[in.x] += chip8->V[in.y];
+    chip8->V[0x0F] = carry;
+)
+
+/* SUB Vx, Vy (8xy5)
+   Set Vx = Vx - Vy, set VF = NOT borrow. */
+CHIP8_OP(SUB,
+    bool no_borrow = (chip8->V[in.x] >= chip8->V[in.y]);
+    chip8->V[in.x] = chip8->V[in.x] - chip8->V[in.y];
+    chip8->V[0x0F] = no_borrow;
+)
+
+/* SHR Vx {, Vy} (8xy6)
+   Legacy: Set Vx = Vy SHR 1.
+   S-CHIP: Set Vx = Vx SHR 1. */
+CHIP8_OP(SHR,
+    if (!CHIP8_QUIRK(1))
+    {
+        chip8->V[in.x] = chip8->V[in.y];
+    }
+
+    int carry = chip8->V[in.x] & 0x01;
+    chip8->V[in.x] >>= 1;
+    chip8->V[0x0F] = carry;
+)
+
+/* SUBN Vx, Vy (8xy7)
+   Set Vx = Vy - Vx, set VF = NOT borrow. */
+CHIP8_OP(SUBN,
+    bool no_borrow = (chip8->V[in.y] >= chip8->V[in.x]);
+    chip8->V[in.x] = chip8->V[in.y] - chip8->V[in.x];
+    chip8->V[0x0F] = no_borrow;
+)
+
+/* SHL Vx {, Vy} (8xyE)
+   Legacy: Set Vx = Vy SHL 1.
+   S-CHIP: Set Vx = Vx SHL 1. */
+CHIP8_OP(SHL,
+    if (!CHIP8_QUIRK(1))
+    {
+        chip8->V[in.x] = chip8->V[in.y];
+    }
+
+    int carry = (chip8->V[in.x] & 0x80) >> 7;
+    chip8->V[in.x] <<= 1;
+    chip8->V[0x0F] = carry;
+)
+
+/* SNE Vx, Vy (9xy0)
+   Skip next instruction if Vx != Vy. */
+CHIP8_OP(SNE_REG,
+    if (chip8->V[in.x] != chip8->V[in.y])
+    {
+        chip8_skip_instr(chip8);
+    }
+)
+
+/* LD I, addr (Annn)
+   Set I = nnn. */
+CHIP8_OP(LD_I,
+    chip8->I = in.nnn;
+)
+
+/* JP V0, addr (Bnnn)
+   Legacy: Jump to location nnn + V0.
+   S-CHIP: Jump to location nnn + Vx. */
+CHIP8_OP(JP_V0,
+    chip8->PC = (!CHIP8_QUIRK(3)) ? chip8->V[0] + in.nnn : chip8->V[in.x] + in.nnn;
+)
+
+/* RND Vx, byte (Cxkk)
+   Set Vx = random byte AND kk. */
+CHIP8_OP(RND,
+    chip8->V[in.x] = (rand() % 0x100) & in.kk;
+)
+
+/* DRW Vx, Vy, n (Dxyn):
+   Legacy: Display n-byte sprite starting at memory location I at (Vx, Vy),
+   set VF = collision.
+   S-CHIP: If hires=false: If n=0, display 8x16 sprite. Else:
+   Same as Legacy. If hires=true: Same as Legacy, except
+   set VF = num rows collision. If n=0: Display 16x16 sprite starting at
+   memory location I at (Vx, Vy), set VF = num rows collision. */
+CHIP8_OP(DRW,
+    CHIP8_DRAW(chip8, chip8->V[in.x], chip8->V[in.y], in.n, chip8->bitplane);
+)
+
+/* SKP Vx (Ex9E)
+   Skip next instruction if key with the value of Vx is pressed. */
+CHIP8_OP(SKP,
+    if (chip8->keypad[chip8->V[in.x]] == KEY_DOWN)
+    {
+        chip8_skip_instr(chip8);
+    }
+)
+
+/* SKNP Vx (ExA1)
+   Skip next instruction if key with the value of Vx is not pressed. */
+CHIP8_OP(SKNP,
+    if (chip8->keypad[chip8->V[in.x]] == KEY_UP)
+    {
+        chip8_skip_instr(chip8);
+    }
+)
+
+/* LD I, nnnn (XO-CHIP Only)
+   Set I = 16-bit address (stored in next two bytes). */
+CHIP8_OP(LD_I_LONG,
+    chip8->I = (chip8->RAM[chip8->PC]) << 8;
+    chip8->I |= (chip8->RAM[chip8->PC + 1]);
+    chip8->PC += 2;
+)
+
+/* PLANE n (XO-CHIP Only)
+   Set the bitplane where 0 <= n <= 3. */
+CHIP8_OP(PLANE,
+    chip8->bitplane = (CHIP8BP)((in.x > NUM_BITPLANES) ? NUM_BITPLANES : in.x);
+)
+
+/* AUDIO (XO-CHIP Only)
+   Store bytes starting at I in the audio pattern buffer. */
+CHIP8_OP(AUDIO,
+    chip8_set_audio_pattern(chip8, chip8->RAM + chip8->I);
+)
+
+/* LD Vx, DT (Fx07)
+   Set Vx = delay timer value. */
+CHIP8_OP(LD_VX_DT,
+    chip8->V[in.x] = chip8->DT;
+)
+
+/* LD Vx, K (Fx0A)
+   Wait for a key press, store the value of the key in Vx. */
+CHIP8_OP(LD_VX_K,
+    chip8_wait_key(chip8, in.x);
+)
+
+/* LD DT, Vx (Fx15)
+   Set delay timer = Vx. */
+CHIP8_OP(LD_DT,
+    chip8->DT = chip8->V[in.x];
+)
+
+/* LD ST, Vx (Fx18)
+   Set sound timer = Vx. */
+CHIP8_OP(LD_ST,
+    chip8->ST = chip8->V[in.x];
+)
+
+/* ADD I, Vx (Fx1E):
+   Set I = I + Vx. */
+CHIP8_OP(ADD_I,
+    chip8->I += chip8->V[in.x];
+)
+
+/* LD F, Vx (Fx29)
+   Set I = location of 5-byte sprite for digit Vx. */
+CHIP8_OP(LD_F,
+    chip8->I = FONT_START_ADDR + (chip8->V[in.x] * 0x05);
+)
+
+/* LD HF, Vx (Fx30) (S-CHIP Only)
+   Set I = location of 10-byte sprite for digit Vx. */
+CHIP8_OP(LD_HF,
+    chip8->I = BIG_FONT_START_ADDR + (chip8->V[in.x] * 0x0A);
+)
+
+/* LD B, Vx (Fx33)
+   Store BCD representation of Vx in memory locations:
+   I, I+1, and I+2. */
+CHIP8_OP(LD_B,
+    chip8_invalidate_code(chip8, chip8->I, 3);
+    chip8->RAM[chip8->I] = (chip8->V[in.x] / 100) % 10;
+    chip8->RAM[chip8->I + 1] = (chip8->V[in.x] / 10) % 10;
+    chip8->RAM[chip8->I + 2] = chip8->V[in.x] % 10;
+)
+
+/* PITCH Vx (Fx3A) (XO-CHIP Only)
+   Set audio pitch to Vx. */
+CHIP8_OP(PITCH,
+    chip8->pitch = chip8->V[in.x];
+)
+
+/* LD [I], Vx (Fx55)
+   Store registers V0 through Vx in memory starting at location I.
+   Legacy: Set I=I+x+1 */
+CHIP8_OP(LD_MEM_VX,
+    chip8_invalidate_code(chip8, chip8->I, in.x + 1);
+    for (int r = 0; r <= in.x; r++)
+    {
+        chip8->RAM[chip8->I + r] = chip8->V[r];
+    }
+
+    if (!CHIP8_QUIRK(2))
+    {
+        chip8->I += (in.x + 1);
+    }
+)
+
+/* LD Vx, [I] (Fx65)
+   Read registers V0 through Vx from memory starting at location I.
+   Legacy: Set I=I+x+1 */
+CHIP8_OP(LD_VX_MEM,
+    for (int r = 0; r <= in.x; r++)
+    {
+        chip8->V[r] = chip8->RAM[chip8->I + r];
+    }
+
+    if (!CHIP8_QUIRK(2))
+    {
+        chip8->I += (in.x + 1);
+    }
+)
+
+/* LD uflags_disk, V0..Vx (Fx75) (S-CHIP Only)
+   Save user flags to disk. */
+CHIP8_OP(SAVE_FLAGS,
+    if (!chip8_handle_user_flags(chip8, in.x + 1, true))
+    {
+        fprintf(stderr, "Unable to save user flags to %s\n",
+                chip8->UF_path);
+    }
+)
+
+/* LD V0..Vx, uflags_disk (Fx85) (S-CHIP Only)
+   Load user flags from disk. */
+CHIP8_OP(LOAD_FLAGS,
+    if (!chip8_handle_user_flags(chip8, in.x + 1, false))
+    {
+        fprintf(stderr, "Unable to load user flags from %s\n",
+                chip8->UF_path);
+    }
+)
@@ -20,8 +20,59 @@ typedef unsigned int pixel_t;
 #define vRGB(r,g,b) (((r) << 16) | ((g) << 8) | (b))
 #endif
 
+/* Vector operations for converting the display to pixels, picked at compile
+   time. Builds without SSE2 (or with NO_SIMD) convert one pixel at a time. */
+#if !defined(NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define FRAME_SIMD
+typedef __m256i frame_vec;
+#define FRAME_VEC_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define FRAME_VEC_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define FRAME_VEC_AND _mm256_and_si256
+#define FRAME_VEC_ANDNOT _mm256_andnot_si256
+#define FRAME_VEC_OR _mm256_or_si256
+#ifdef USE_RGB565
+#define FRAME_VEC_SET1(x) _mm256_set1_epi16((short)(x))
+#define FRAME_VEC_CMPEQ _mm256_cmpeq_epi16
+#else
+#define FRAME_VEC_SET1(x) _mm256_set1_epi32((int)(x))
+#define FRAME_VEC_CMPEQ _mm256_cmpeq_epi32
+#endif
+#elif !defined(NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+			     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define FRAME_SIMD
+typedef __m128i frame_vec;
+#define FRAME_VEC_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define FRAME_VEC_STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define FRAME_VEC_AND _mm_and_si128
+#define FRAME_VEC_ANDNOT _mm_andnot_si128
+#define FRAME_VEC_OR _mm_or_si128
+#ifdef USE_RGB565
+#define FRAME_VEC_SET1(x) _mm_set1_epi16((short)(x))
+#define FRAME_VEC_CMPEQ _mm_cmpeq_epi16
+#else
+#define FRAME_VEC_SET1(x) _mm_set1_epi32((int)(x))
+#define FRAME_VEC_CMPEQ _mm_cmpeq_epi32
+#endif
+#endif
+
+#ifdef FRAME_SIMD
+// Pixels per vector.
+#define FRAME_VEC_LANES (int)(sizeof(frame_vec) / sizeof(pixel_t))
+// Lanes of m taken from a, the others from b.
+#define FRAME_VEC_SELECT(m, a, b) FRAME_VEC_OR(FRAME_VEC_AND(m, a), FRAME_VEC_ANDNOT(m, b))
+#endif
+
 static pixel_t frame[DISPLAY_WIDTH * DISPLAY_HEIGHT];
 
+/* Whether frame shows the display as of the last retro_run with the
+current theme, so only dirty rows need converting. */
+static bool frame_current = false;
+
+// Whether the frontend accepts NULL frames to repeat the previous one.
+static bool can_dupe = false;
+
 static retro_environment_t environ_cb;
 static retro_log_printf_t log_cb;
 static retro_video_refresh_t video_cb;
@@ -33,16 +84,42 @@ static retro_audio_sample_batch_t audio_batch_cb;
 static CHIP8 chip8;
 static unsigned long cpu_debt = 0;
 
+/* The RAM as of the last check for writes from the frontend, compared in
+   blocks of RAM_CHECK_BLOCK bytes (see check_ram_writes). */
+#define RAM_CHECK_BLOCK 256
+static uint8_t ram_shadow[MAX_RAM];
+
 #if !defined(SF2000)
 #define AUDIO_RESAMPLE_RATE 44100
 #else
 #define AUDIO_RESAMPLE_RATE 11025
 #endif
 
-static unsigned int audio_counter_chip8 = 0;
-static unsigned int audio_counter_resample = 0;
-static unsigned int audio_freq_chip8 = 0;
-static int snd_buf_pntr = 0;
+/* Position in the audio pattern, in bits with AUDIO_PHASE_FRAC fractional
+bits. It advances by the pattern's rate over the output rate every sample. */
+#define AUDIO_PHASE_FRAC 32
+static uint64_t audio_phase = 0;
+// Samples owed to the next frame, in 1/refresh_freq units.
+static unsigned long audio_debt = 0;
+
+/* The sound of the machine from an instruction of the frame on. The timers
+   and the pattern only change between batches of instructions, so the
+   frame's audio is synthesized from these afterwards, in one go. */
+struct sound_event {
+    unsigned instr;
+    bool beep;
+    uint8_t pitch;
+    uint32_t freq; // Of the pitch, see chip8_get_sound_freq_fixed.
+    uint8_t pattern[AUDIO_PATTERN_BITS];
+};
+
+#define MAX_SOUND_EVENTS 64
+static struct sound_event sound_events[MAX_SOUND_EVENTS];
+static unsigned num_sound_events = 0;
+
+// The audio of the frame, in stereo samples.
+#define AUDIO_FRAME_MAX (AUDIO_RESAMPLE_RATE / REFRESH_FREQ_DEFAULT + 1)
+static int16_t audio_frame[AUDIO_FRAME_MAX * 2];
 static uint8_t sram[NUM_USER_FLAGS];
 
 struct theme {
@@ -95,10 +172,13 @@ static const struct theme color_themes[] = {
     {vRGB(0,0,0), vRGB(0,0xFF,0), vRGB(0xFF,0,0), vRGB(0xFF,0xFF,0), "CGA 0"},
     {vRGB(0,0,0), vRGB(0xFF,0,0xFF), vRGB(0,0xFF,0xFF), vRGB(0xFF,0xFF,0xFF), "CGA 1"}
 };
-static pixel_t bg_color = BG_COLOR_DEFAULT;
-static pixel_t p1_color = P1_COLOR_DEFAULT;
-static pixel_t p2_color = P2_COLOR_DEFAULT;
-static pixel_t overlap_color = OVERLAP_COLOR_DEFAULT;
+
+/* Colors of the current theme, indexed by the bits of both planes
+   (plane 1 in bit 0, plane 2 in bit 1). */
+static pixel_t palette[4] = {
+    BG_COLOR_DEFAULT, P1_COLOR_DEFAULT, P2_COLOR_DEFAULT, OVERLAP_COLOR_DEFAULT
+};
+static int theme_current = -1;
 
 static void fallback_log(enum retro_log_level level,
 			 const char *fmt, ...) {
@@ -194,7 +274,7 @@ static struct retro_variable variables[] =
     },
     {
 	"jaxe_cpu_requency",
-	"CPU frequency; 1000|1500|2000|3000|5000|10000|25000|50000|100000|800|750|600|500|400|300",
+	"CPU frequency; 1000|1500|2000|3000|5000|10000|25000|50000|100000|200000|500000|1000000|2000000|5000000|10000000|20000000|50000000|800|750|600|500|400|300",
     },
     {
 	"jaxe_theme",
@@ -304,10 +384,15 @@ static void load_theme(void)
 	}
     }
 
-    bg_color = color_themes[theme_number].bg;
-    p1_color = color_themes[theme_number].p1;
-    p2_color = color_themes[theme_number].p2;
-    overlap_color = color_themes[theme_number].overlap;
+    if (theme_number == theme_current)
+	return;
+
+    theme_current = theme_number;
+    palette[0] = color_themes[theme_number].bg;
+    palette[1] = color_themes[theme_number].p1;
+    palette[2] = color_themes[theme_number].p2;
+    palette[3] = color_themes[theme_number].overlap;
+    frame_current = false;
 }
 
 #if defined(SF2000)
@@ -385,36 +470,56 @@ static void chip8_init_with_vars(void)
 
     chip8_init(&chip8, cpu_freq, timer_freq, refresh_freq, pc_start_addr,
 	       quirks);
+
+    // Frames are emulated, not timed, so the timers count instructions.
+    chip8_set_deterministic(&chip8, true);
 }
 
-// Makes the physical screen match the emulator display.
-void draw_display(void)
+// Makes the given rows of the physical screen match the emulator display.
+void draw_display(uint64_t rows)
 {
+#ifdef FRAME_SIMD
+    /* Each vector converts FRAME_VEC_LANES pixels. The plane bits of those
+       pixels are broadcast to every lane and lane i keeps only the bit of
+       pixel i, giving a mask per plane that selects from the palette. */
+    pixel_t lane_bits[FRAME_VEC_LANES];
+    for (int i = 0; i < FRAME_VEC_LANES; i++)
+	lane_bits[i] = (pixel_t)(1u << (FRAME_VEC_LANES - 1 - i));
+
+    const frame_vec sel = FRAME_VEC_LOAD(lane_bits);
+    const frame_vec bg = FRAME_VEC_SET1(palette[0]);
+    const frame_vec p1 = FRAME_VEC_SET1(palette[1]);
+    const frame_vec p2 = FRAME_VEC_SET1(palette[2]);
+    const frame_vec overlap = FRAME_VEC_SET1(palette[3]);
+    const uint64_t group = (1u << FRAME_VEC_LANES) - 1;
+#endif
+
     for (int y = 0; y < DISPLAY_HEIGHT; y++)
     {
-	for (int x = 0; x < DISPLAY_WIDTH; x++)
+	if (!(rows & ((uint64_t)1 << y)))
+	    continue;
+
+	const uint64_t *row1 = chip8.display[y];
+	const uint64_t *row2 = chip8.display2[y];
+	pixel_t *out = frame + y * DISPLAY_WIDTH;
+
+#ifdef FRAME_SIMD
+	for (int x = 0; x < DISPLAY_WIDTH; x += FRAME_VEC_LANES)
 	{
-	    pixel_t color;
-
-	    if (!chip8.display[y][x] && !chip8.display2[y][x])
-	    {
-		color = bg_color;
-	    }
-	    else if (chip8.display[y][x] && !chip8.display2[y][x])
-	    {
-		color = p1_color;
-	    }
-	    else if (!chip8.display[y][x] && chip8.display2[y][x])
-	    {
-		color = p2_color;
-	    }
-	    else
-	    {
-		color = overlap_color;
-	    }
-
-	    frame[x + y * DISPLAY_WIDTH] = color;
+	    int shift = 64 - FRAME_VEC_LANES - (x & 63);
+	    frame_vec m1 = FRAME_VEC_SET1((row1[x >> 6] >> shift) & group);
+	    frame_vec m2 = FRAME_VEC_SET1((row2[x >> 6] >> shift) & group);
+	    m1 = FRAME_VEC_CMPEQ(FRAME_VEC_AND(m1, sel), sel);
+	    m2 = FRAME_VEC_CMPEQ(FRAME_VEC_AND(m2, sel), sel);
+
+	    frame_vec lo = FRAME_VEC_SELECT(m1, p1, bg);
+	    frame_vec hi = FRAME_VEC_SELECT(m1, overlap, p2);
+	    FRAME_VEC_STORE(out + x, FRAME_VEC_SELECT(m2, hi, lo));
 	}
+#else
+	for (int x = 0; x < DISPLAY_WIDTH; x++)
+	    out[x] = palette[DISPLAY_PIXEL(row1, x) | (DISPLAY_PIXEL(row2, x) << 1)];
+#endif
     }
 }
 
@@ -426,6 +531,8 @@ void retro_set_input_state(retro_input_state_t fn) { input_state_cb = fn; }
 
 void retro_init(void)
 {
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+	can_dupe = false;
 }
 
 static void *rom_buf = NULL;
@@ -434,15 +541,28 @@ static size_t rom_size = 0;
 
 static void load_rom(void) {
     cpu_debt = 0;
-    audio_counter_chip8 = 0;
-    audio_counter_resample = 0;
-    audio_freq_chip8 = 0;
-    snd_buf_pntr = 0;
+    audio_phase = 0;
+    audio_debt = 0;
 
     chip8_init_with_vars();
     chip8_load_font(&chip8);
 
     chip8_load_rom_buffer(&chip8, rom_data, rom_size);
+    memcpy(ram_shadow, chip8.RAM, sizeof(ram_shadow));
+}
+
+/* The frontend can write the RAM it gets from retro_get_memory_data
+   (cheats, achievements) between frames without the core knowing, so
+   decoded and translated code of any block that changed since the last
+   check is discarded. Blocks the program wrote itself were already
+   invalidated and only get rechecked. */
+static void check_ram_writes(void) {
+    for (size_t a = 0; a < MAX_RAM; a += RAM_CHECK_BLOCK) {
+	if (memcmp(chip8.RAM + a, ram_shadow + a, RAM_CHECK_BLOCK) != 0) {
+	    chip8_invalidate_code(&chip8, (uint16_t)a, RAM_CHECK_BLOCK);
+	    memcpy(ram_shadow + a, chip8.RAM + a, RAM_CHECK_BLOCK);
+	}
+    }
 }
 
 bool retro_load_game(const struct retro_game_info *info)
@@ -493,47 +613,75 @@ void retro_unload_game(void)
     rom_size = 0;
 }
 
-int16_t get_audio_sample(void)
-{
-    // Get the byte of the emulator's buffer that the next sample is in.
-    int16_t x = chip8.RAM[AUDIO_BUF_ADDR + (snd_buf_pntr / 8)];
+// Sample of a low and a high bit of the pattern.
+static const int16_t audio_levels[2] = {0, 0x80 * 0xFF};
 
-    // Get the actual sample bit.
-    x <<= (snd_buf_pntr % 8);
-    x &= 0x80;
+// Fills out with len stereo samples of the given sound.
+static void synthesize(const struct sound_event *sound, int16_t *out, unsigned len) {
+    if (!sound->beep) {
+	// Every beep starts at the beginning of the pattern.
+	audio_phase = 0;
+	memset(out, 0, len * 2 * sizeof(*out));
+	return;
+    }
 
-    // Finally set the buffer to max volume if sample is 1.
-    x *= 0xFF;
+    // Pattern bits per output sample.
+    uint64_t step = ((uint64_t)sound->freq << (AUDIO_PHASE_FRAC - SOUND_FREQ_FRAC)) /
+		    AUDIO_RESAMPLE_RATE;
+    uint64_t phase = audio_phase;
 
-    /* Keep track of where we are in the emulator's sound buffer and
-       wrap back around if necessary. */
-    snd_buf_pntr++;
-    if (snd_buf_pntr >= (AUDIO_BUF_SIZE * 8))
-    {
-	snd_buf_pntr = 0;
+    for (unsigned i = 0; i < len; i++) {
+	int16_t x = audio_levels[sound->pattern[(phase >> AUDIO_PHASE_FRAC) % AUDIO_PATTERN_BITS]];
+	out[i * 2] = x;
+	out[i * 2 + 1] = x;
+	phase += step;
     }
 
-    return x;
+    audio_phase = phase % ((uint64_t)AUDIO_PATTERN_BITS << AUDIO_PHASE_FRAC);
 }
 
-static void audio_sample(int16_t sample) {
-    int16_t buf[200]; // Should be enough to call batch_cb only once
-    // in most cases
-    int16_t *bufptr = buf;
-    while (audio_counter_resample >= ONE_SEC / AUDIO_RESAMPLE_RATE) {
-	*bufptr++ = sample;
-	*bufptr++ = sample;
-	if (bufptr >= buf + sizeof(buf) / sizeof(buf[0])) {
-	    audio_batch_cb(buf, (bufptr - buf) / 2);
-	    bufptr = buf;
-	}
-	audio_counter_resample -= ONE_SEC / AUDIO_RESAMPLE_RATE;
-    }
+/* Notes the sound playing from instr instructions into the frame on, if it
+   differs from the sound before. */
+static void record_sound(unsigned instr) {
+    const struct sound_event *last = num_sound_events ? &sound_events[num_sound_events - 1] : NULL;
+    if (num_sound_events == MAX_SOUND_EVENTS ||
+	(last && last->beep == chip8.beep && last->pitch == chip8.pitch &&
+	 memcmp(last->pattern, chip8.audio_pattern, AUDIO_PATTERN_BITS) == 0))
+	return;
 
-    if (bufptr != buf) {
-	audio_batch_cb(buf, (bufptr - buf) / 2);
+    struct sound_event *sound = &sound_events[num_sound_events++];
+    sound->instr = instr;
+    sound->beep = chip8.beep;
+    sound->pitch = chip8.pitch;
+    sound->freq = chip8_get_sound_freq_fixed(&chip8);
+    memcpy(sound->pattern, chip8.audio_pattern, AUDIO_PATTERN_BITS);
+}
+
+/* Synthesizes the audio of a frame of num_instrs instructions from the
+   sounds recorded during it, and submits it at once. Every frame gets
+   exactly its share of the output rate, each sound the part of it its
+   instructions took. */
+static void render_audio(unsigned num_instrs) {
+    unsigned len = (AUDIO_RESAMPLE_RATE + audio_debt) / chip8.refresh_freq;
+    audio_debt = (AUDIO_RESAMPLE_RATE + audio_debt) % chip8.refresh_freq;
+    if (len > AUDIO_FRAME_MAX)
+	len = AUDIO_FRAME_MAX;
+
+    for (unsigned i = 0; i < num_sound_events; i++) {
+	unsigned end = (i + 1 < num_sound_events) ? sound_events[i + 1].instr : num_instrs;
+	unsigned from = (unsigned)((uint64_t)sound_events[i].instr * len / num_instrs);
+	unsigned to = (unsigned)((uint64_t)end * len / num_instrs);
+	synthesize(&sound_events[i], audio_frame + from * 2, to - from);
     }
+
+    if (!num_sound_events)
+	memset(audio_frame, 0, len * 2 * sizeof(*audio_frame));
+
+    audio_batch_cb(audio_frame, len);
+
+    num_sound_events = 0;
 }
+
 #if defined(SF2000)
 static void check_joypad_variable(const char joypad_key, int joypad_variable, bool *joypad_press)
 {
@@ -583,6 +731,8 @@ void retro_run(void)
 	    chip8_set_cpu_freq(&chip8, cpu_freq);
     }
 
+    check_ram_writes();
+
     input_poll_cb();
 
     #if !defined(SF2000)
@@ -602,53 +752,37 @@ void retro_run(void)
 
     #endif
 
-    uint64_t cycle_step = ONE_SEC / chip8.cpu_freq;
-
-    for (unsigned i = 0; i < (chip8.cpu_freq + cpu_debt) / chip8.refresh_freq && !chip8.exit; i++) {
-	chip8.total_cycle_time = cycle_step;
-	chip8_execute(&chip8);
-	if (chip8.timer_freq != chip8.refresh_freq)
-	    chip8_handle_timers(&chip8);
-
-	if (!chip8.beep) {
-	    audio_freq_chip8 = 0;
-	    audio_counter_chip8 = 0;
-	    snd_buf_pntr = 0;
-	    audio_counter_resample += cycle_step;
-	    audio_sample(0);
-	} else {
-	    uint64_t cycle_audio_step;
-	    if (!audio_freq_chip8) {
-		audio_freq_chip8 = chip8_get_sound_freq(&chip8);
-		snd_buf_pntr = 0;
-	    }
-	    cycle_audio_step = ONE_SEC / audio_freq_chip8;
-	    audio_counter_chip8 += cycle_step;
-	    while (audio_counter_chip8 > cycle_audio_step) {
-		audio_counter_chip8 -= cycle_audio_step;
-		int16_t sample = get_audio_sample();
-		audio_counter_resample += cycle_audio_step;
-		audio_sample(sample);
-	    }
-	}
-    }
-
-    if (chip8.timer_freq == chip8.refresh_freq) {
+    unsigned num_instrs = (chip8.cpu_freq + cpu_debt) / chip8.refresh_freq;
 
-    	if (chip8.DT > 0){
-    	    chip8.DT--;
-        }
+    /* Run the frame in batches ending at each timer tick or refresh. The
+       timers, and with them the beep, only change in between, so the sound
+       of each batch is recorded before it runs. */
+    unsigned i = 0;
+    while (i < num_instrs && !chip8.exit) {
+	uint32_t batch = chip8_instructions_to_event(&chip8);
+	if (batch > num_instrs - i)
+	    batch = num_instrs - i;
 
-    	if (chip8.ST > 0){
-    	    chip8.ST--;
-            chip8.beep =  chip8.ST > 0 ? true : false;
-        }
+	record_sound(i);
+	i += chip8_run_deterministic(&chip8, batch);
     }
 
+    render_audio(num_instrs);
+
     cpu_debt = (chip8.cpu_freq + cpu_debt) % chip8.refresh_freq;
 
-    // Output video
-    draw_display();
+    // Output video, converting only the rows that changed.
+    uint64_t dirty = frame_current ? chip8_get_dirty_rows(&chip8) : DISPLAY_ALL_ROWS;
+    chip8_clear_dirty_rows(&chip8);
+
+    if (dirty == 0 && can_dupe) {
+	video_cb(NULL, DISPLAY_WIDTH, DISPLAY_HEIGHT, sizeof(pixel_t) * DISPLAY_WIDTH);
+	return;
+    }
+
+    chip8_sync_display(&chip8);
+    draw_display(dirty);
+    frame_current = true;
     video_cb(frame, DISPLAY_WIDTH, DISPLAY_HEIGHT, sizeof(pixel_t) * DISPLAY_WIDTH);
 }
 
@@ -702,10 +836,8 @@ struct serialized_state
 {
     CHIP8 chip8;
     unsigned long cpu_debt;
-    unsigned int audio_counter_chip8;
-    unsigned int audio_counter_resample;
-    unsigned int audio_freq_chip8;
-    int snd_buf_pntr;
+    uint64_t audio_phase;
+    unsigned long audio_debt;
     uint8_t sram[NUM_USER_FLAGS];
 };
 
@@ -722,10 +854,8 @@ bool retro_serialize(void *data, size_t size)
     struct serialized_state *st = (struct serialized_state *) data;
     memcpy(&st->chip8, &chip8, sizeof(st->chip8));
     st->cpu_debt = cpu_debt;
-    st->audio_counter_chip8 = audio_counter_chip8;
-    st->audio_counter_resample = audio_counter_resample;
-    st->audio_freq_chip8 = audio_freq_chip8;
-    st->snd_buf_pntr = snd_buf_pntr;
+    st->audio_phase = audio_phase;
+    st->audio_debt = audio_debt;
     memcpy(st->sram, sram, sizeof(st->sram));
     return true;
 }
@@ -737,11 +867,12 @@ bool retro_unserialize(const void *data, size_t size)
 
     const struct serialized_state *st = (struct serialized_state *) data;
     memcpy(&chip8, &st->chip8, sizeof(chip8));
+    chip8_invalidate_code(&chip8, 0, MAX_RAM);
+    memcpy(ram_shadow, chip8.RAM, sizeof(ram_shadow));
+    frame_current = false;
     cpu_debt = st->cpu_debt;
-    audio_counter_chip8 = st->audio_counter_chip8;
-    audio_counter_resample = st->audio_counter_resample;
-    audio_freq_chip8 = st->audio_freq_chip8;
-    snd_buf_pntr = st->snd_buf_pntr;
+    audio_phase = st->audio_phase;
+    audio_debt = st->audio_debt;
     memcpy(sram, st->sram, sizeof(st->sram));
     return true;
 }
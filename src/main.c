@@ -5,7 +5,13 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#ifndef WIN32
+#include <errno.h>
+#include <time.h>
+#endif
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
 #include <SDL2/SDL_ttf.h>
@@ -13,12 +19,22 @@
 
 #define BAD_KEY 0x42
 
-#define DBG_STACK_MAX 1000
+// Bytes of rewind history kept and most steps it can hold.
+#define DBG_HISTORY_BYTES (4 * 1024 * 1024)
+#define DBG_HISTORY_STEPS 65536
+// Bytes of the machine compared at once when looking for changes.
+#define DBG_HISTORY_BLOCK 64
 #define DBG_PANEL_WIDTH 200
 #define DBG_PANEL_HEIGHT 320
 #define DBG_FONT_FILE "../fonts/dbgfont.ttf"
 #define DBG_FONT_SIZE 12
 
+#define UNCAPPED_BATCH_SIZE 10000
+
+#define NSEC_PER_SEC 1000000000LL
+// Frames the scheduler may fall behind before it gives up catching up.
+#define MAX_FRAMES_BEHIND 4
+
 #define DISPLAY_SCALE_DEFAULT 5
 #define DISPLAY_SCALE_MAX 20
 #define BG_COLOR_DEFAULT 0x000000
@@ -28,7 +44,27 @@
 #define NUM_COLOR_THEMES (int)(sizeof(color_themes) / sizeof(color_themes[0]))
 
 // Sound
+#define AUDIO_SAMPLE_RATE 44100
+// Samples the device asks for at a time.
+#define AUDIO_DEVICE_SAMPLES 512
+// Samples kept queued ahead of the device (about two frames).
+#define AUDIO_QUEUE_TARGET (AUDIO_SAMPLE_RATE / 30)
+// Capacity of the sample ring (a power of two above the target).
+#define AUDIO_RING_SIZE 4096
+#define AUDIO_AMPLITUDE 8192
+
+SDL_AudioDeviceID audio_device = 0;
+int audio_rate = AUDIO_SAMPLE_RATE;
+/* Samples synthesized by the emulator for the audio callback. Only the
+emulator advances audio_ring_head and only the callback advances
+audio_ring_tail, so the ring needs no lock. */
+int16_t audio_ring[AUDIO_RING_SIZE];
+SDL_atomic_t audio_ring_head;
+SDL_atomic_t audio_ring_tail;
+/* Bit of the pattern playing and progress towards the next, in units of
+1/audio_rate with SOUND_FREQ_FRAC fractional bits. */
 int snd_buf_pntr = 0;
+uint64_t snd_phase = 0;
 
 // Emulator
 CHIP8 chip8;
@@ -37,9 +73,9 @@ uint16_t pc_start_addr = PC_START_ADDR_DEFAULT;
 unsigned long cpu_freq = CPU_FREQ_DEFAULT;
 unsigned long timer_freq = TIMER_FREQ_DEFAULT;
 unsigned long refresh_freq = REFRESH_FREQ_DEFAULT;
-bool play_sound = false;
 bool quirks[NUM_QUIRKS] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
 bool load_dmp = false;
+bool deterministic = false;
 
 // Color/Display
 // TODO: Add more themes!
@@ -62,7 +98,10 @@ long color_themes[] = {
 };
 int color_theme_pntr = 0;
 SDL_Window *window = NULL;
-SDL_Surface *surface = NULL;
+SDL_Renderer *renderer = NULL;
+// The display as a 128x64 texture, scaled up by the renderer.
+SDL_Texture *display_texture = NULL;
+Uint32 display_pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
 int display_scale = DISPLAY_SCALE_DEFAULT;
 long bg_color = BG_COLOR_DEFAULT;
 long p1_color = P1_COLOR_DEFAULT;
@@ -70,40 +109,242 @@ long p2_color = P2_COLOR_DEFAULT;
 long overlap_color = OVERLAP_COLOR_DEFAULT;
 TTF_Font *dbg_font = NULL;
 
+// The debug panel, rebuilt only when what it shows changes.
+typedef struct
+{
+    uint16_t PC, SP, I;
+    uint8_t opcode[2];
+    uint8_t DT, ST;
+    uint8_t V[NUM_REGISTERS];
+} DBGVIEW;
+
+SDL_Texture *dbg_texture = NULL;
+DBGVIEW dbg_view;
+
 // Debugger
-/* This stack holds instances of the chip8 emulator after every execution.
-It is used to be able to step back the emulator. */
-CHIP8 dbg_stack[DBG_STACK_MAX];
-int dbg_stack_pntr = 0;
+/* The rewind history lets the emulator step back. Its prev is the machine as
+of the last step pushed, and every step records what it changed: each run of
+changed bytes of the machine with the values they had before. Stepping back
+undoes the newest step, so it only touches what that step changed. A step
+that changes more than a copy of the machine takes (a reset, loading a dump)
+is recorded as a full keyframe. Steps live in a ring of DBG_HISTORY_BYTES;
+the oldest are forgotten to make room. The history is only allocated when the
+debugger is enabled, so running without it neither reserves nor touches it. */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t len;
+} DBGRUN;
+
+typedef struct
+{
+    uint64_t pos; // Never wraps, the data is at pos % DBG_HISTORY_BYTES.
+    uint32_t len;
+} DBGSTEP;
+
+typedef struct
+{
+    CHIP8 prev;
+    uint8_t delta[sizeof(DBGRUN) + sizeof(CHIP8)];
+    DBGSTEP steps[DBG_HISTORY_STEPS];
+    unsigned first_step;
+    unsigned num_steps;
+    uint64_t end;
+    uint8_t data[DBG_HISTORY_BYTES];
+} DBGHISTORY;
+
+DBGHISTORY *dbg_history = NULL;
+// Called after every instruction the debugger runs, NULL if nothing records them.
+void (*dbg_record_step)() = NULL;
 bool debug_mode = false;
 bool paused = false;
 bool dbg_step = false;
 bool dbg_step_back = false;
 
-// Push the emulator state onto the debug stack.
+// Scheduler
+/* Frame n is due at pacing_start + n / refresh_freq seconds on the monotonic
+clock. Deadlines are computed from the start rather than from the previous
+frame, so sleeping late never accumulates into drift. */
+int64_t pacing_start = 0;
+int64_t frame_count = 0;
+// Instructions owed to the next frame, in 1/refresh_freq units.
+unsigned long frame_cpu_cum = 0;
+
+// Frame time statistics, reported on exit with -j.
+bool report_jitter = false;
+int64_t last_frame_end = 0;
+unsigned long timed_frames = 0;
+unsigned long missed_frames = 0;
+double frame_time_sum = 0;
+double frame_time_sq_sum = 0;
+int64_t frame_time_min = 0;
+int64_t frame_time_max = 0;
+
+/* Encodes the runs of bytes that differ between old and cur, with the values
+of old, into out (of max bytes). Changes less than a run header apart are
+joined into one run. Returns false if they don't fit. */
+bool dbg_diff(const uint8_t *old, const uint8_t *cur, size_t size, uint8_t *out, size_t max,
+              size_t *out_len)
+{
+    size_t n = 0;
+    size_t i = 0;
+    while (i < size)
+    {
+        // Skip unchanged blocks at once.
+        if (i % DBG_HISTORY_BLOCK == 0 && i + DBG_HISTORY_BLOCK <= size &&
+            memcmp(old + i, cur + i, DBG_HISTORY_BLOCK) == 0)
+        {
+            i += DBG_HISTORY_BLOCK;
+            continue;
+        }
+
+        if (old[i] == cur[i])
+        {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        size_t end = i + 1;
+        for (i = end; i < size && i - end < sizeof(DBGRUN); i++)
+        {
+            if (old[i] != cur[i])
+            {
+                end = i + 1;
+            }
+        }
+        i = end;
+
+        DBGRUN run = {(uint32_t)start, (uint32_t)(end - start)};
+        if (n + sizeof(run) + run.len > max)
+        {
+            return false;
+        }
+
+        memcpy(out + n, &run, sizeof(run));
+        memcpy(out + n + sizeof(run), old + start, run.len);
+        n += sizeof(run) + run.len;
+    }
+
+    *out_len = n;
+    return true;
+}
+
+/* Copies the bytes of every run of delta from src (or the run's own data if
+src is NULL) into dst. */
+void dbg_apply(uint8_t *dst, const uint8_t *src, const uint8_t *delta, size_t len)
+{
+    for (size_t n = 0; n < len;)
+    {
+        DBGRUN run;
+        memcpy(&run, delta + n, sizeof(run));
+        n += sizeof(run);
+        memcpy(dst + run.offset, src ? src + run.offset : delta + n, run.len);
+        n += run.len;
+    }
+}
+
+// Forgets every step pushed.
+void dbg_history_clear()
+{
+    if (dbg_history)
+    {
+        dbg_history->prev = chip8;
+        dbg_history->first_step = 0;
+        dbg_history->num_steps = 0;
+    }
+}
+
+// Push the emulator state onto the rewind history.
 void dbg_stack_push()
 {
-    dbg_stack_pntr++;
+    DBGHISTORY *h = dbg_history;
+    size_t len;
+    if (!dbg_diff((const uint8_t *)&h->prev, (const uint8_t *)&chip8, sizeof(CHIP8), h->delta,
+                  sizeof(h->delta), &len))
+    {
+        // A keyframe: all of the previous state.
+        DBGRUN run = {0, sizeof(CHIP8)};
+        memcpy(h->delta, &run, sizeof(run));
+        memcpy(h->delta + sizeof(run), &h->prev, sizeof(CHIP8));
+        len = sizeof(h->delta);
+    }
 
-    if (dbg_stack_pntr >= DBG_STACK_MAX)
+    // Keep steps contiguous, skipping the end of the ring if they don't fit.
+    uint64_t pos = h->end;
+    if ((pos % DBG_HISTORY_BYTES) + len > DBG_HISTORY_BYTES)
     {
-        dbg_stack_pntr = 0;
+        pos += DBG_HISTORY_BYTES - (pos % DBG_HISTORY_BYTES);
     }
+    h->end = pos + len;
 
-    dbg_stack[dbg_stack_pntr] = chip8;
+    // Forget the oldest steps the new one overwrites (or that don't fit).
+    while (h->num_steps > 0 &&
+           (h->num_steps == DBG_HISTORY_STEPS ||
+            h->steps[h->first_step].pos + DBG_HISTORY_BYTES < h->end))
+    {
+        h->first_step = (h->first_step + 1) % DBG_HISTORY_STEPS;
+        h->num_steps--;
+    }
+
+    DBGSTEP *step = &h->steps[(h->first_step + h->num_steps) % DBG_HISTORY_STEPS];
+    step->pos = pos;
+    step->len = (uint32_t)len;
+    h->num_steps++;
+    memcpy(h->data + (pos % DBG_HISTORY_BYTES), h->delta, len);
+
+    dbg_apply((uint8_t *)&h->prev, (const uint8_t *)&chip8, h->delta, len);
 }
 
-// Pop the previous emulator state from debug stack.
+/* Allocates the rewind history, starting it from the current emulator state,
+and starts recording every step into it. */
+bool dbg_history_init()
+{
+    if (!dbg_history)
+    {
+        dbg_history = malloc(sizeof(DBGHISTORY));
+        if (!dbg_history)
+        {
+            return false;
+        }
+
+        dbg_history->end = 0;
+    }
+
+    dbg_history_clear();
+    dbg_record_step = dbg_stack_push;
+    return true;
+}
+
+// Stops recording steps and frees the rewind history.
+void dbg_history_free()
+{
+    dbg_record_step = NULL;
+    free(dbg_history);
+    dbg_history = NULL;
+}
+
+// Pop the previous emulator state from the rewind history.
 void dbg_stack_pop()
 {
-    dbg_stack_pntr--;
+    DBGHISTORY *h = dbg_history;
+    if (!h)
+    {
+        return;
+    }
 
-    if (dbg_stack_pntr < 0)
+    if (h->num_steps > 0)
     {
-        dbg_stack_pntr = DBG_STACK_MAX - 1;
+        h->num_steps--;
+        DBGSTEP *step = &h->steps[(h->first_step + h->num_steps) % DBG_HISTORY_STEPS];
+        dbg_apply((uint8_t *)&h->prev, NULL, h->data + (step->pos % DBG_HISTORY_BYTES),
+                  step->len);
+        h->end = step->pos;
     }
 
-    chip8 = dbg_stack[dbg_stack_pntr];
+    chip8 = h->prev;
+    chip8_invalidate_code(&chip8, 0, MAX_RAM);
+    chip8_mark_display_dirty(&chip8);
     dbg_step = true;
     dbg_step_back = true;
 }
@@ -121,21 +362,59 @@ void cycle_color_theme()
     p1_color = color_themes[color_theme_pntr + 1];
     p2_color = color_themes[color_theme_pntr + 2];
     overlap_color = color_themes[color_theme_pntr + 3];
+    chip8_mark_display_dirty(&chip8);
+}
+
+// Prints how evenly frames were paced.
+void report_frame_times()
+{
+    if (timed_frames == 0)
+    {
+        return;
+    }
+
+    double mean = frame_time_sum / timed_frames;
+    double variance = (frame_time_sq_sum / timed_frames) - (mean * mean);
+
+    fprintf(stderr, "Frames: %lu, missed deadlines: %lu\n",
+            timed_frames, missed_frames);
+    fprintf(stderr, "Frame time: mean %.3f ms, jitter %.3f ms, min %.3f ms, max %.3f ms\n",
+            mean / 1e6, sqrt(variance > 0 ? variance : 0) / 1e6,
+            frame_time_min / 1e6, frame_time_max / 1e6);
 }
 
 // Frees all resources and exits.
 void clean_exit(int status)
 {
+    if (report_jitter)
+    {
+        report_frame_times();
+    }
+
     if (debug_mode && dbg_font)
     {
         TTF_CloseFont(dbg_font);
         dbg_font = NULL;
     }
 
-    if (surface)
+    dbg_history_free();
+
+    if (dbg_texture)
+    {
+        SDL_DestroyTexture(dbg_texture);
+        dbg_texture = NULL;
+    }
+
+    if (display_texture)
     {
-        SDL_FreeSurface(surface);
-        surface = NULL;
+        SDL_DestroyTexture(display_texture);
+        display_texture = NULL;
+    }
+
+    if (renderer)
+    {
+        SDL_DestroyRenderer(renderer);
+        renderer = NULL;
     }
 
     if (window)
@@ -144,7 +423,12 @@ void clean_exit(int status)
         window = NULL;
     }
 
-    SDL_CloseAudio();
+    if (audio_device)
+    {
+        SDL_CloseAudioDevice(audio_device);
+        audio_device = 0;
+    }
+
     SDL_Quit();
 
     exit(status);
@@ -174,73 +458,90 @@ void get_ROM_name(char *rom_name)
     strtok(rom_name, ".");
 }
 
-// Creates a square sound wave based off the MSB of the emulator's sound buffer.
-void squarewave_callback(void *snddata, Uint8 *buffer, int bytes)
+// Plays the samples queued in the ring, or silence if it runs dry.
+void audio_callback(void *userdata, Uint8 *stream, int len)
 {
-    (void)snddata;
-
-    for (int i = 0; i < bytes; i++)
-    {
-        // Get the byte of the emulator's buffer that the next sample is in.
-        buffer[i] = chip8.RAM[AUDIO_BUF_ADDR + (snd_buf_pntr / 8)];
+    (void)userdata;
 
-        // Get the actual sample bit.
-        buffer[i] <<= (snd_buf_pntr % 8);
-        buffer[i] &= 0x80;
+    int16_t *out = (int16_t *)stream;
+    int samples = len / (int)sizeof(int16_t);
+    int tail = SDL_AtomicGet(&audio_ring_tail);
+    int queued = (SDL_AtomicGet(&audio_ring_head) - tail) & (AUDIO_RING_SIZE - 1);
 
-        // Finally set the buffer to max volume if sample is 1.
-        buffer[i] *= 0xFF;
-
-        /* Keep track of where we are in the emulator's sound buffer and
-        wrap back around if necessary. */
-        snd_buf_pntr++;
-        if (snd_buf_pntr >= (AUDIO_BUF_SIZE * 8))
-        {
-            snd_buf_pntr = 0;
-        }
+    for (int i = 0; i < samples; i++)
+    {
+        out[i] = (i < queued) ? audio_ring[(tail + i) & (AUDIO_RING_SIZE - 1)] : 0;
     }
+
+    SDL_AtomicSet(&audio_ring_tail, (tail + (queued < samples ? queued : samples)) &
+                                        (AUDIO_RING_SIZE - 1));
 }
 
-// Start playing a sound.
-void start_sound()
+// Opens the audio device, which keeps playing (silence too) until exit.
+void init_audio()
 {
-    snd_buf_pntr = 0;
-
     SDL_AudioSpec want;
-
-    // Returns 4000 * 2^((pitch - 64) / 48)
-    want.freq = chip8_get_sound_freq(&chip8);
-
-    // We only need 1 bit so might as well select smallest format
-    want.format = AUDIO_U8;
-
-    // No need for stereo so use mono
+    memset(&want, 0, sizeof(want));
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
     want.channels = 1;
-
-    // Not exactly sure why a lower number works better but 2 is lowest possible
-    want.samples = 2;
-
-    want.callback = squarewave_callback;
+    want.samples = AUDIO_DEVICE_SAMPLES;
+    want.callback = audio_callback;
 
     SDL_AudioSpec have;
-    if (SDL_OpenAudio(&want, &have) != 0)
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (!audio_device)
     {
         fprintf(stderr, "Could not open audio: %s.\n", SDL_GetError());
+        return;
     }
 
-    if (want.format != have.format)
+    audio_rate = have.freq;
+    SDL_PauseAudioDevice(audio_device, 0);
+}
+
+/* Tops the ring up with the sound the machine makes now: a square wave
+following the bits of the pattern buffer (MSB first) at the pitch's rate. */
+void queue_sound()
+{
+    if (!audio_device)
     {
-        fprintf(stderr, "Could not get desired audio spec.\n");
+        return;
     }
 
-    SDL_PauseAudio(0);
-}
+    int head = SDL_AtomicGet(&audio_ring_head);
+    int queued = (head - SDL_AtomicGet(&audio_ring_tail)) & (AUDIO_RING_SIZE - 1);
 
-// Stop playing sound.
-void stop_sound()
-{
-    SDL_PauseAudio(1);
-    SDL_CloseAudio();
+    // 4000 * 2^((pitch - 64) / 48) in fixed point.
+    uint32_t freq = chip8.beep ? chip8_get_sound_freq_fixed(&chip8) : 0;
+    uint64_t bit_len = (uint64_t)audio_rate << SOUND_FREQ_FRAC;
+    static const int16_t levels[2] = {-AUDIO_AMPLITUDE, AUDIO_AMPLITUDE};
+
+    for (; queued < AUDIO_QUEUE_TARGET; queued++)
+    {
+        int16_t sample = 0;
+        if (freq)
+        {
+            sample = levels[chip8.audio_pattern[snd_buf_pntr]];
+
+            // Move on through the pattern, wrapping back around at its end.
+            for (snd_phase += freq; snd_phase >= bit_len; snd_phase -= bit_len)
+            {
+                snd_buf_pntr = (snd_buf_pntr + 1) % AUDIO_PATTERN_BITS;
+            }
+        }
+        else
+        {
+            // Every beep starts at the beginning of the pattern.
+            snd_buf_pntr = 0;
+            snd_phase = 0;
+        }
+
+        audio_ring[head] = sample;
+        head = (head + 1) & (AUDIO_RING_SIZE - 1);
+    }
+
+    SDL_AtomicSet(&audio_ring_head, head);
 }
 
 // Initializes SDL.
@@ -253,6 +554,8 @@ bool init_SDL()
         return false;
     }
 
+    init_audio();
+
     return true;
 }
 
@@ -277,7 +580,7 @@ bool handle_args(int argc, char **argv)
 
 #ifdef ALLOW_GETOPTS
         int opt;
-        while ((opt = getopt(argc, argv, "012345678xldms:p:c:t:r:f:b:n:k:")) != -1)
+        while ((opt = getopt(argc, argv, "012345678xldmjis:p:c:t:r:f:b:n:k:")) != -1)
         {
             switch (opt)
             {
@@ -329,6 +632,16 @@ bool handle_args(int argc, char **argv)
                 load_dmp = true;
                 break;
 
+            // Tick timers by instruction count instead of host time
+            case 'i':
+                deterministic = true;
+                break;
+
+            // Report frame-time jitter on exit
+            case 'j':
+                report_jitter = true;
+                break;
+
             // Set display scale
             case 's':
                 display_scale = atoi(optarg);
@@ -412,10 +725,18 @@ bool init_emulator()
         return false;
     }
 
-    // Initialize the dbg stack with instances of the initial emulator state.
-    for (int i = 0; i < DBG_STACK_MAX; i++)
+    if (deterministic && !chip8.cpu_freq)
     {
-        dbg_stack[i] = chip8;
+        fprintf(stderr, "Deterministic timing needs a CPU frequency.\n");
+        return false;
+    }
+
+    chip8_set_deterministic(&chip8, deterministic);
+
+    // Only the debugger records the rewind history.
+    if (debug_mode && !dbg_history_init())
+    {
+        fprintf(stderr, "Could not allocate the rewind history.\n");
     }
 
     return true;
@@ -471,58 +792,136 @@ SDL_Window *create_window()
     return new_window;
 }
 
-// Sets a pixel of the SDL surface to a certain color.
-void set_pixel(int x, int y, long color)
+/* Create the renderer and the texture the display is drawn into. Falls back
+to the software renderer where there is no accelerated one. */
+bool create_renderer()
 {
-    Uint32 *pixels = (Uint32 *)surface->pixels;
-    pixels[(y * surface->w) + x] = color;
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (!renderer)
+    {
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    }
+
+    if (!renderer)
+    {
+        fprintf(stderr, "Could not create SDL renderer: %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Keep pixels sharp when scaling the display up.
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+
+    display_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                        SDL_TEXTUREACCESS_STREAMING,
+                                        DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (!display_texture)
+    {
+        fprintf(stderr, "Could not create SDL texture: %s\n", SDL_GetError());
+        return false;
+    }
+
+    return true;
 }
 
-// Makes the physical screen match the emulator display.
-void draw_display()
+/* Makes the display texture match the emulator display. Only rows that
+changed are converted and uploaded. Returns whether anything changed. */
+bool draw_display()
 {
-    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    chip8_sync_display(&chip8);
+
+    uint64_t dirty = chip8_get_dirty_rows(&chip8);
+    chip8_clear_dirty_rows(&chip8);
+
+    if (!dirty)
     {
-        for (int x = 0; x < DISPLAY_WIDTH; x++)
+        return false;
+    }
+
+    // Colors indexed by the bits of both planes (plane 1 in bit 0).
+    Uint32 colors[4] = {
+        0xFF000000 | bg_color, 0xFF000000 | p1_color,
+        0xFF000000 | p2_color, 0xFF000000 | overlap_color};
+
+    for (int y = 0; y < DISPLAY_HEIGHT;)
+    {
+        if (!(dirty & ((uint64_t)1 << y)))
         {
-            for (int i = 0; i < display_scale; i++)
+            y++;
+            continue;
+        }
+
+        // Convert and upload the whole run of changed rows at once.
+        int first = y;
+        for (; y < DISPLAY_HEIGHT && (dirty & ((uint64_t)1 << y)); y++)
+        {
+            Uint32 *out = &display_pixels[y * DISPLAY_WIDTH];
+            for (int x = 0; x < DISPLAY_WIDTH; x++)
             {
-                for (int j = 0; j < display_scale; j++)
-                {
-                    int sdl_x = (x * display_scale) + j;
-                    int sdl_y = (y * display_scale) + i;
-                    long color;
-
-                    if (!chip8.display[y][x] && !chip8.display2[y][x])
-                    {
-                        color = bg_color;
-                    }
-                    else if (chip8.display[y][x] && !chip8.display2[y][x])
-                    {
-                        color = p1_color;
-                    }
-                    else if (!chip8.display[y][x] && chip8.display2[y][x])
-                    {
-                        color = p2_color;
-                    }
-                    else if (chip8.display[y][x] && chip8.display2[y][x])
-                    {
-                        color = overlap_color;
-                    }
-
-                    set_pixel(sdl_x, sdl_y, color);
-                }
+                out[x] = colors[DISPLAY_PIXEL(chip8.display[y], x) |
+                                (DISPLAY_PIXEL(chip8.display2[y], x) << 1)];
             }
         }
+
+        SDL_Rect rows;
+        rows.x = 0;
+        rows.y = first;
+        rows.w = DISPLAY_WIDTH;
+        rows.h = y - first;
+        SDL_UpdateTexture(display_texture, &rows, &display_pixels[first * DISPLAY_WIDTH],
+                          DISPLAY_WIDTH * sizeof(Uint32));
     }
 
-    SDL_UpdateWindowSurface(window);
+    return true;
 }
 
-/* Display the debug panel.
+// Puts the display (and debug panel) on screen.
+void present_display()
+{
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+
+    SDL_Rect dest_rect;
+    dest_rect.x = 0;
+    dest_rect.y = 0;
+    dest_rect.w = DISPLAY_WIDTH * display_scale;
+    dest_rect.h = DISPLAY_HEIGHT * display_scale;
+    SDL_RenderCopy(renderer, display_texture, NULL, &dest_rect);
+
+    if (debug_mode && dbg_texture)
+    {
+        dest_rect.x = (DISPLAY_WIDTH * display_scale) + 1;
+        dest_rect.y = 0;
+        dest_rect.w = DBG_PANEL_WIDTH - 1;
+        dest_rect.h = DBG_PANEL_HEIGHT;
+        SDL_RenderCopy(renderer, dbg_texture, NULL, &dest_rect);
+    }
+
+    SDL_RenderPresent(renderer);
+}
+
+/* Rebuild the debug panel texture if what it shows changed. Returns whether
+it did.
 This function is nasty and slow as hell, I am not proud of it. */
-void draw_debug()
+bool draw_debug()
 {
+    DBGVIEW view;
+    memset(&view, 0, sizeof(view));
+    view.PC = chip8.PC;
+    view.SP = chip8.SP;
+    view.I = chip8.I;
+    view.opcode[0] = chip8.RAM[chip8.PC];
+    view.opcode[1] = chip8.RAM[chip8.PC + 1];
+    view.DT = chip8.DT;
+    view.ST = chip8.ST;
+    memcpy(view.V, chip8.V, sizeof(view.V));
+
+    if (dbg_texture && memcmp(&view, &dbg_view, sizeof(view)) == 0)
+    {
+        return false;
+    }
+
+    memcpy(&dbg_view, &view, sizeof(view));
+
     // Create a gray rectangle surface as the side panel for debug.
     SDL_Surface *dbg_panel = SDL_CreateRGBSurface(0,
                                                   DBG_PANEL_WIDTH,
@@ -530,12 +929,6 @@ void draw_debug()
                                                   32, 0, 0, 0, 0);
     SDL_FillRect(dbg_panel, NULL, SDL_MapRGB(dbg_panel->format, 200, 200, 200));
 
-    SDL_Rect dest_rect;
-    dest_rect.x = (DISPLAY_WIDTH * display_scale) + 1;
-    dest_rect.y = 0;
-    dest_rect.w = DBG_PANEL_WIDTH - 1;
-    dest_rect.h = DBG_PANEL_HEIGHT;
-
     // Now create text with useful information.
     SDL_Surface *txt = NULL;
     SDL_Color font_color;
@@ -642,10 +1035,16 @@ void draw_debug()
     SDL_BlitSurface(txt, NULL, dbg_panel, &font_dest_rect);
     SDL_FreeSurface(txt);
 
-    // Finally blit debug panel onto window.
-    SDL_BlitSurface(dbg_panel, NULL, surface, &dest_rect);
+    // Finally turn the debug panel into a texture.
+    if (dbg_texture)
+    {
+        SDL_DestroyTexture(dbg_texture);
+    }
+
+    dbg_texture = SDL_CreateTextureFromSurface(renderer, dbg_panel);
     SDL_FreeSurface(dbg_panel);
-    SDL_UpdateWindowSurface(window);
+
+    return true;
 }
 
 // Converts an SDL key code to the respective key on the emulator keypad.
@@ -707,32 +1106,248 @@ unsigned char SDLK_to_hex(SDL_Keycode key)
     }
 }
 
-// Handles sound.
-void handle_sound()
+// Current time of the monotonic clock in nanoseconds.
+int64_t monotonic_ns()
+{
+#ifdef WIN32
+    return (int64_t)((double)SDL_GetPerformanceCounter() * NSEC_PER_SEC /
+                     SDL_GetPerformanceFrequency());
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+#endif
+}
+
+// Sleeps until the monotonic clock reaches deadline (in nanoseconds).
+void sleep_until(int64_t deadline)
 {
-    if (!play_sound && chip8.beep)
+#ifdef WIN32
+    int64_t left = deadline - monotonic_ns();
+    if (left > 0)
     {
-        play_sound = true;
-        start_sound();
+        SDL_Delay((Uint32)(left / 1000000));
     }
-    else if (play_sound && !chip8.beep)
+#else
+    struct timespec ts;
+    ts.tv_sec = deadline / NSEC_PER_SEC;
+    ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
     {
-        play_sound = false;
-        stop_sound();
     }
+#endif
+}
+
+// Runs up to max instructions, stopping early if the program exits.
+void run_instructions(uint32_t max)
+{
+    for (uint32_t i = 0; i < max;)
+    {
+        uint32_t executed;
+        CHIP8RUN result = chip8_run(&chip8, max - i, &executed);
+        i += executed;
+
+        if (result == RUN_EXIT)
+        {
+            break;
+        }
+    }
+}
+
+/* Runs one frame: every instruction the CPU executes in 1/refresh_freq
+seconds as a batch, split into slices no longer than a timer period so the
+timers tick in between. With an uncapped CPU each slice runs until it is due
+to end instead. */
+void run_frame()
+{
+    unsigned long slices = 1;
+    if (chip8.timer_freq > chip8.refresh_freq)
+    {
+        slices = (chip8.timer_freq + chip8.refresh_freq - 1) / chip8.refresh_freq;
+    }
+
+    int64_t frame_start = monotonic_ns();
+    int64_t frame_ns = NSEC_PER_SEC / chip8.refresh_freq;
+    // Time the timers in slices exactly (see chip8_set_cycle_time).
+    chip8_set_cycle_time(&chip8, 1, chip8.refresh_freq * slices);
+
+    uint32_t owed = 0;
+    if (chip8.cpu_freq)
+    {
+        frame_cpu_cum += chip8.cpu_freq;
+        owed = frame_cpu_cum / chip8.refresh_freq;
+        frame_cpu_cum %= chip8.refresh_freq;
+    }
+
+    // Deterministic timing ticks the timers at instruction counts instead.
+    if (chip8.deterministic)
+    {
+        chip8_run_deterministic(&chip8, owed);
+        slices = 0;
+    }
+
+    for (unsigned long s = 0; s < slices && !chip8.exit; s++)
+    {
+        if (chip8.cpu_freq)
+        {
+            run_instructions((owed * (s + 1) / slices) - (owed * s / slices));
+        }
+        else
+        {
+            int64_t slice_end = frame_start + (frame_ns * (s + 1) / slices);
+            while (!chip8.exit && chip8.state == STATE_RUNNING &&
+                   monotonic_ns() < slice_end)
+            {
+                run_instructions(UNCAPPED_BATCH_SIZE);
+            }
+        }
+
+        chip8_handle_timers(&chip8);
+    }
+
+    // Every frame ends with a screen refresh.
+    chip8.display_updated = true;
+    chip8.refresh_cum = 0;
+}
+
+/* Runs the emulator for one iteration of the main loop. With a refresh
+frequency that is a frame (see run_frame). Otherwise it runs every
+instruction the CPU owes for the time elapsed since the last call, then
+handles the timers. In debug mode instructions run one per call so each can
+be recorded in the rewind history. */
+void run_emulator()
+{
+    if (debug_mode)
+    {
+        /* Record the state of the emulator if the CPU actually executed an
+        instruction and wasn't sleeping. */
+        if (chip8_cycle(&chip8) && dbg_record_step)
+        {
+            dbg_record_step();
+        }
+
+        return;
+    }
+
+    if (chip8.refresh_freq)
+    {
+        run_frame();
+        return;
+    }
+
+    chip8_update_elapsed_time(&chip8);
+
+    uint32_t owed = UNCAPPED_BATCH_SIZE;
+    if (chip8.cpu_freq)
+    {
+        chip8.cpu_cum += chip8.total_cycle_time * chip8.cpu_freq;
+        uint64_t due = chip8.cpu_cum / chip8.time_base;
+        chip8.cpu_cum %= chip8.time_base;
+
+        // Don't try to catch up on more than a tenth of a second.
+        owed = (due > chip8.cpu_freq / 10 + 1) ? chip8.cpu_freq / 10 + 1 : (uint32_t)due;
+    }
+
+    if (chip8.deterministic)
+    {
+        chip8_run_deterministic(&chip8, owed);
+        return;
+    }
+
+    run_instructions(owed);
+    chip8_handle_timers(&chip8);
+}
+
+/* Sleeps until the next frame is due and records how long the frame took.
+A host that falls more than MAX_FRAMES_BEHIND frames behind starts pacing
+over from now instead of running frames back to back to catch up. */
+void wait_for_frame()
+{
+    frame_count++;
+    int64_t deadline = pacing_start + (frame_count * NSEC_PER_SEC / chip8.refresh_freq);
+    int64_t now = monotonic_ns();
+
+    if (now > deadline)
+    {
+        missed_frames++;
+    }
+
+    if (now - deadline > MAX_FRAMES_BEHIND * NSEC_PER_SEC / (int64_t)chip8.refresh_freq)
+    {
+        pacing_start = now;
+        frame_count = 0;
+    }
+    else
+    {
+        sleep_until(deadline);
+    }
+
+    now = monotonic_ns();
+    if (last_frame_end)
+    {
+        int64_t frame_time = now - last_frame_end;
+        if (timed_frames == 0 || frame_time < frame_time_min)
+        {
+            frame_time_min = frame_time;
+        }
+        if (frame_time > frame_time_max)
+        {
+            frame_time_max = frame_time;
+        }
+
+        frame_time_sum += frame_time;
+        frame_time_sq_sum += (double)frame_time * frame_time;
+        timed_frames++;
+    }
+
+    last_frame_end = now;
+}
+
+/* Without a refresh frequency to pace frames by, the main loop spins. While
+the program waits for a key or is halted nothing but the timers can
+change, so block until an input event (a key or a reset) arrives or the next
+timer tick or refresh is due instead of spinning. */
+void wait_for_input()
+{
+    if (debug_mode || paused || chip8.state == STATE_RUNNING)
+    {
+        return;
+    }
+
+    unsigned long freq = chip8.refresh_freq;
+    if ((chip8.DT > 0 || chip8.ST > 0) && chip8.timer_freq > freq)
+    {
+        freq = chip8.timer_freq;
+    }
+
+    SDL_WaitEventTimeout(NULL, freq ? 1000 / freq : 1);
+}
+
+// Handles sound.
+void handle_sound()
+{
+    queue_sound();
 }
 
 // Handles drawing the display.
 void handle_display()
 {
+    bool changed = false;
+
     if (chip8.display_updated)
     {
-        draw_display();
+        changed |= draw_display();
     }
 
     if (debug_mode)
     {
-        draw_debug();
+        changed |= draw_debug();
+    }
+
+    if (changed)
+    {
+        present_display();
     }
 }
 
@@ -750,6 +1365,15 @@ bool handle_input(SDL_Event *e)
             return false;
             break;
 
+        // Redraw after the window was covered.
+        case SDL_WINDOWEVENT:
+            if (e->window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                present_display();
+            }
+
+            break;
+
         case SDL_KEYUP:
             hexkey = SDLK_to_hex(e->key.keysym.sym);
             keyc = e->key.keysym.sym;
@@ -787,9 +1411,13 @@ bool handle_input(SDL_Event *e)
                 chip8_set_cpu_freq(&chip8, chip8.cpu_freq + 100);
                 break;
 
-            // Decrease CPU frequency
+            // Decrease CPU frequency, stopping short of 0 (or wrapping).
             case SDLK_LEFT:
-                chip8_set_cpu_freq(&chip8, chip8.cpu_freq - 100);
+                if (chip8.cpu_freq > 100)
+                {
+                    chip8_set_cpu_freq(&chip8, chip8.cpu_freq - 100);
+                }
+
                 break;
 
             // Dump memory to disk
@@ -847,29 +1475,32 @@ int main(int argc, char **argv)
         clean_exit(1);
     }
 
-    surface = SDL_GetWindowSurface(window);
-    if (!surface)
+    if (!create_renderer())
     {
-        fprintf(stderr, "Could not create SDL surface: %s\n", SDL_GetError());
         clean_exit(1);
     }
 
     SDL_Event e;
+    pacing_start = monotonic_ns();
     while (!chip8.exit && handle_input(&e))
     {
         if ((!paused || dbg_step) && !dbg_step_back)
         {
-            /* Push the state of the emulator into debug stack if the CPU
-            actually executed an instruction and wasn't sleeping. */
-            if (chip8_cycle(&chip8))
-            {
-                dbg_stack_push();
-            }
+            run_emulator();
         }
 
         handle_sound();
         handle_display();
 
+        if (chip8.refresh_freq && !debug_mode)
+        {
+            wait_for_frame();
+        }
+        else
+        {
+            wait_for_input();
+        }
+
         dbg_step = false;
         dbg_step_back = false;
     }
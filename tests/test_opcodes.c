@@ -13,26 +13,28 @@ void test_0000()
     assert(chip8.PC == PC_START_ADDR_DEFAULT);
     chip8_execute(&chip8);
     assert(chip8.PC == PC_START_ADDR_DEFAULT);
+    assert(chip8.state == STATE_HALTED);
 
     chip8_reset(&chip8);
+    assert(chip8.state == STATE_RUNNING);
 }
 
 void test_00Cn()
 {
     chip8_load_instr(&chip8, 0x00C5);
 
-    chip8.display[6][9] = true;
-    chip8.display[DISPLAY_HEIGHT - 1][9] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, 9, DISPLAY_HEIGHT - 1, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[11][9]);
-    assert(chip8.display[DISPLAY_HEIGHT - 1][9]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 11));
+    assert(chip8_get_pixel(&chip8, BP1, 9, DISPLAY_HEIGHT - 1));
 
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[11][9]);
-    assert(!chip8.display[DISPLAY_HEIGHT - 1][9]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 9, 11));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, DISPLAY_HEIGHT - 1));
 
     chip8_reset(&chip8);
 }
@@ -41,18 +43,18 @@ void test_00Dn()
 {
     chip8_load_instr(&chip8, 0x00D5);
 
-    chip8.display[6][9] = true;
-    chip8.display[0][9] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, 9, 0, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[1][9]);
-    assert(chip8.display[0][9]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 1));
+    assert(chip8_get_pixel(&chip8, BP1, 9, 0));
 
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[1][9]);
-    assert(!chip8.display[0][9]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 9, 1));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 0));
 
     chip8_reset(&chip8);
 }
@@ -61,11 +63,11 @@ void test_00E0()
 {
     chip8_load_instr(&chip8, 0x00E0);
 
-    chip8.display[0][0] = true;
-    chip8.display[DISPLAY_HEIGHT / 2][DISPLAY_WIDTH / 2] = true;
-    chip8.display[DISPLAY_HEIGHT - 1][0] = true;
-    chip8.display[0][DISPLAY_WIDTH - 1] = true;
-    chip8.display[DISPLAY_HEIGHT - 1][DISPLAY_WIDTH - 1] = true;
+    chip8_set_pixel(&chip8, BP1, 0, 0, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH / 2, DISPLAY_HEIGHT / 2, true);
+    chip8_set_pixel(&chip8, BP1, 0, DISPLAY_HEIGHT - 1, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 0, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1, true);
 
     chip8_execute(&chip8);
 
@@ -73,7 +75,7 @@ void test_00E0()
     {
         for (int j = 0; j < DISPLAY_WIDTH; j++)
         {
-            assert(chip8.display[i][j] == false);
+            assert(chip8_get_pixel(&chip8, BP1, j, i) == false);
         }
     }
 
@@ -100,18 +102,18 @@ void test_00FB()
 {
     chip8_load_instr(&chip8, 0x00FB);
 
-    chip8.display[6][9] = true;
-    chip8.display[6][DISPLAY_WIDTH - 1] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 6, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[6][13]);
-    assert(chip8.display[6][DISPLAY_WIDTH - 1]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 13, 6));
+    assert(chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 6));
 
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[6][13]);
-    assert(!chip8.display[6][DISPLAY_WIDTH - 1]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 13, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 6));
 
     chip8_reset(&chip8);
 }
@@ -120,18 +122,18 @@ void test_00FC()
 {
     chip8_load_instr(&chip8, 0x00FC);
 
-    chip8.display[6][9] = true;
-    chip8.display[6][0] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, 0, 6, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[6][5]);
-    assert(chip8.display[6][0]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 5, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 0, 6));
 
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[6][5]);
-    assert(!chip8.display[6][0]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 5, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 0, 6));
 
     chip8_reset(&chip8);
 }
@@ -460,7 +462,7 @@ void test_8xy6()
     assert(chip8.V[0x0F] == 0x00);
 
     // Turn off S-CHIP quirk for this instruction
-    chip8.quirks[1] = false;
+    chip8_set_quirk(&chip8, 1, false);
 
     // Check least-significant bit 1
     chip8.PC = chip8.pc_start_addr;
@@ -478,7 +480,7 @@ void test_8xy6()
     assert(chip8.V[6] == 0x21);
     assert(chip8.V[0x0F] == 0x00);
 
-    chip8.quirks[1] = true;
+    chip8_set_quirk(&chip8, 1, true);
     chip8_reset(&chip8);
 }
 
@@ -529,7 +531,7 @@ void test_8xyE()
     assert(chip8.V[0x0F] == 0x01);
 
     // Turn off S-CHIP quirk for this instruction
-    chip8.quirks[1] = false;
+    chip8_set_quirk(&chip8, 1, false);
 
     // Check most significant bit 0
     chip8.PC = chip8.pc_start_addr;
@@ -547,7 +549,7 @@ void test_8xyE()
     assert(chip8.V[6] == 0xE0);
     assert(chip8.V[0x0F] == 0x01);
 
-    chip8.quirks[1] = true;
+    chip8_set_quirk(&chip8, 1, true);
     chip8_reset(&chip8);
 }
 
@@ -588,14 +590,14 @@ void test_Bnnn()
     assert(chip8.PC == 0xC16);
 
     // Disable S-CHIP quirk
-    chip8.quirks[3] = false;
+    chip8_set_quirk(&chip8, 3, false);
     chip8.PC = chip8.pc_start_addr;
     chip8.V[0] = 0x69;
     chip8.V[0xB] = 0x42;
     chip8_execute(&chip8);
     assert(chip8.PC == 0xC16);
 
-    chip8.quirks[3] = true;
+    chip8_set_quirk(&chip8, 3, true);
     chip8_reset(&chip8);
 }
 
@@ -619,7 +621,7 @@ void test_Dxyn()
     {
         for (int x = 0; x < 6; x++)
         {
-            chip8.display[y][x] = true;
+            chip8_set_pixel(&chip8, BP1, x, y, true);
         }
     }
 
@@ -640,18 +642,58 @@ void test_Dxyn()
         {
             if (y < 4 || x < 4)
             {
-                assert(chip8.display[y][x]);
+                assert(chip8_get_pixel(&chip8, BP1, x, y));
             }
             else
             {
-                assert(!chip8.display[y][x]);
+                assert(!chip8_get_pixel(&chip8, BP1, x, y));
             }
         }
     }
-    assert(chip8.display[6][6]);
+    assert(chip8_get_pixel(&chip8, BP1, 6, 6));
     assert(chip8.V[0xF] == 1);
 
     chip8_reset(&chip8);
+
+    // 16x16 sprite in hires mode wrapping around the bottom-right corner.
+    chip8_set_quirk(&chip8, 6, false);
+    chip8_set_quirk(&chip8, 8, false);
+    chip8_load_instr(&chip8, 0xD010);
+    chip8.hires = true;
+
+    for (int i = 0; i < 32; i++)
+    {
+        chip8.RAM[0x300 + i] = 0xFF;
+    }
+
+    chip8.I = 0x300;
+    chip8.V[0] = DISPLAY_WIDTH - 8;
+    chip8.V[1] = DISPLAY_HEIGHT - 4;
+
+    chip8_execute(&chip8);
+
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        for (int x = 0; x < DISPLAY_WIDTH; x++)
+        {
+            bool on = (x < 8 || x >= DISPLAY_WIDTH - 8) &&
+                      (y < 12 || y >= DISPLAY_HEIGHT - 4);
+            assert(chip8_get_pixel(&chip8, BP1, x, y) == on);
+        }
+    }
+    assert(chip8.V[0xF] == 0);
+
+    // Drawing it again erases it, colliding on every row.
+    chip8.PC = PC_START_ADDR_DEFAULT;
+    chip8_execute(&chip8);
+
+    assert(!chip8_get_pixel(&chip8, BP1, 0, 0));
+    assert(!chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1));
+    assert(chip8.V[0xF] == 16);
+
+    chip8_set_quirk(&chip8, 6, true);
+    chip8_set_quirk(&chip8, 8, true);
+    chip8_reset(&chip8);
 }
 
 void test_Ex9E()
@@ -747,7 +789,14 @@ void test_F002()
         assert(chip8.RAM[AUDIO_BUF_ADDR + i] == i);
     }
 
+    // The pattern is also kept one bit per entry, MSB first.
+    for (int i = 0; i < AUDIO_PATTERN_BITS; i++)
+    {
+        assert(chip8.audio_pattern[i] == (((i / 8) >> (7 - (i % 8))) & 1));
+    }
+
     chip8_reset(&chip8);
+    assert(chip8.audio_pattern[0] == 0 && chip8.audio_pattern[AUDIO_PATTERN_BITS - 1] == 1);
 }
 
 void test_Fx07()
@@ -768,10 +817,12 @@ void test_Fx0A()
     chip8.keypad[0xA] = KEY_DOWN;
     chip8_execute(&chip8);
     assert(chip8.PC == chip8.pc_start_addr);
+    assert(chip8.state == STATE_KEY_WAIT);
 
     chip8.keypad[0xA] = KEY_RELEASED;
     chip8_execute(&chip8);
     assert(chip8.PC == chip8.pc_start_addr + 2 && chip8.V[0] == 0xA);
+    assert(chip8.state == STATE_RUNNING);
 
     chip8_reset(&chip8);
 }
@@ -875,7 +926,11 @@ void test_Fx3A()
     chip8_execute(&chip8);
     assert(chip8.pitch == 247);
 
+    // 4000 * 2^((247 - 64) / 48) Hz, about 56.2 kHz.
+    assert(chip8_get_sound_freq_fixed(&chip8) >> SOUND_FREQ_FRAC == 56200);
+
     chip8_reset(&chip8);
+    assert(chip8_get_sound_freq_fixed(&chip8) == (uint32_t)4000 << SOUND_FREQ_FRAC);
 }
 
 void test_Fx55()
@@ -893,12 +948,12 @@ void test_Fx55()
     assert(chip8.I == before_I);
 
     // Disable S-CHIP quirk for this instruction
-    chip8.quirks[2] = false;
+    chip8_set_quirk(&chip8, 2, false);
     chip8.PC = chip8.pc_start_addr;
     chip8_execute(&chip8);
     assert(chip8.I == before_I + 3);
 
-    chip8.quirks[2] = true;
+    chip8_set_quirk(&chip8, 2, true);
     chip8_reset(&chip8);
 }
 
@@ -918,12 +973,12 @@ void test_Fx65()
     assert(chip8.I == before_I);
 
     // Disable S-CHIP quirk for this instruction
-    chip8.quirks[2] = false;
+    chip8_set_quirk(&chip8, 2, false);
     chip8.PC = chip8.pc_start_addr;
     chip8_execute(&chip8);
     assert(chip8.I == before_I + 3);
 
-    chip8.quirks[2] = true;
+    chip8_set_quirk(&chip8, 2, true);
     chip8_reset(&chip8);
 }
 
@@ -951,10 +1006,389 @@ void test_Fx75_Fx85()
     chip8_reset(&chip8);
 }
 
+void test_execute_instrs()
+{
+    // Sum 1 to 10 into V1 then jump in place forever.
+    const uint8_t rom[] = {0x60, 0x00, 0x70, 0x01, 0x81, 0x04, 0x30, 0x0A,
+                           0x12, 0x02, 0x12, 0x0A};
+    chip8_load_rom_buffer(&chip8, rom, sizeof(rom));
+
+    assert(chip8_execute_instrs(&chip8, 6) == 6);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 4);
+    assert(chip8.V[0] == 2);
+    assert(chip8.V[1] == 1);
+
+    assert(chip8_execute_instrs(&chip8, 94) == 94);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 10);
+    assert(chip8.V[0] == 10);
+    assert(chip8.V[1] == 55);
+    assert(chip8.V[0x0F] == 0);
+
+    // Code modified from outside has to be picked up.
+    chip8.RAM[PC_START_ADDR_DEFAULT + 7] = 0x05;
+    chip8_invalidate_code(&chip8, PC_START_ADDR_DEFAULT + 7, 1);
+    chip8.PC = PC_START_ADDR_DEFAULT;
+    assert(chip8_execute_instrs(&chip8, 100) == 100);
+    assert(chip8.V[0] == 5);
+    assert(chip8.V[1] == 55 + 15);
+
+    chip8_reset(&chip8);
+
+    // The same loop at an odd address, where Octo often places code.
+    const uint8_t odd_rom[] = {0x12, 0x03, 0x00, 0x60, 0x00, 0x70, 0x01, 0x81,
+                               0x04, 0x30, 0x0A, 0x12, 0x05, 0x12, 0x0D};
+    chip8_load_rom_buffer(&chip8, odd_rom, sizeof(odd_rom));
+
+    assert(chip8_execute_instrs(&chip8, 7) == 7);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 7);
+    assert(chip8.V[0] == 2);
+    assert(chip8.V[1] == 1);
+
+    assert(chip8_execute_instrs(&chip8, 94) == 94);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 13);
+    assert(chip8.V[0] == 10);
+    assert(chip8.V[1] == 55);
+
+    chip8.RAM[PC_START_ADDR_DEFAULT + 10] = 0x05;
+    chip8_invalidate_code(&chip8, PC_START_ADDR_DEFAULT + 10, 1);
+    chip8.PC = PC_START_ADDR_DEFAULT + 3;
+    assert(chip8_execute_instrs(&chip8, 100) == 100);
+    assert(chip8.V[0] == 5);
+    assert(chip8.V[1] == 55 + 15);
+
+    chip8_reset(&chip8);
+}
+
+void test_run()
+{
+    // Count V0 up to 5, draw, wait for a key, exit. Then halt.
+    const uint8_t rom[] = {0x60, 0x00, 0x70, 0x01, 0x30, 0x05, 0x12, 0x02,
+                           0xD0, 0x01, 0xF1, 0x0A, 0x00, 0xFD, 0x00, 0x00};
+    uint32_t executed;
+
+    chip8_load_rom_buffer(&chip8, rom, sizeof(rom));
+    chip8_reset_keypad(&chip8);
+
+    assert(chip8_run(&chip8, 4, &executed) == RUN_BUDGET);
+    assert(executed == 4);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 2);
+
+    assert(chip8_run(&chip8, 100, &executed) == RUN_DISPLAY);
+    assert(executed == 12);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 10);
+    assert(chip8.V[0] == 5);
+
+    // Keep waiting (without executing anything) until a key is released.
+    assert(chip8_run(&chip8, 100, &executed) == RUN_KEY_WAIT);
+    assert(executed == 100);
+    assert(chip8.state == STATE_KEY_WAIT);
+    chip8.keypad[7] = KEY_DOWN;
+    assert(chip8_run(&chip8, 100, &executed) == RUN_KEY_WAIT);
+    assert(executed == 100);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 10);
+
+    chip8.keypad[7] = KEY_RELEASED;
+    assert(chip8_run(&chip8, 100, &executed) == RUN_EXIT);
+    assert(executed == 2);
+    assert(chip8.state == STATE_RUNNING);
+    assert(chip8.V[1] == 7);
+    assert(chip8.keypad[7] == KEY_UP);
+    assert(chip8_run(&chip8, 100, &executed) == RUN_EXIT);
+    assert(executed == 0);
+
+    // Halting uses up the budget, and stays halted without executing.
+    chip8.exit = false;
+    assert(chip8_run(&chip8, 100, &executed) == RUN_HALT);
+    assert(executed == 100);
+    assert(chip8.state == STATE_HALTED);
+    assert(chip8_run(&chip8, 100, &executed) == RUN_HALT);
+    assert(executed == 100);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 14);
+
+    chip8_reset(&chip8);
+}
+
+void test_idle_loop()
+{
+    // Wait for DT to reach 0, then exit.
+    const uint8_t rom[] = {0xF0, 0x07, 0x30, 0x00, 0x12, 0x00, 0x00, 0xFD};
+    uint32_t executed;
+
+    chip8_load_rom_buffer(&chip8, rom, sizeof(rom));
+    chip8_reset_keypad(&chip8);
+    assert(chip8_is_idle_loop(chip8.RAM, PC_START_ADDR_DEFAULT));
+    assert(!chip8_is_idle_loop(chip8.RAM, PC_START_ADDR_DEFAULT + 2));
+
+    // Everything after the first LD V0, DT is skipped in whole iterations.
+    chip8.DT = 3;
+    assert(chip8_run(&chip8, 100, &executed) == RUN_IDLE);
+    assert(executed == 100);
+    assert(chip8.idle_instrs == 99);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT + 2);
+    assert(chip8.V[0] == 3);
+
+    assert(chip8_run(&chip8, 2, &executed) == RUN_BUDGET);
+    assert(executed == 2);
+    assert(chip8.PC == PC_START_ADDR_DEFAULT);
+
+    chip8.DT = 0;
+    assert(chip8_run(&chip8, 100, &executed) == RUN_EXIT);
+    assert(executed == 3);
+    assert(chip8.idle_instrs == 99);
+
+    chip8_reset(&chip8);
+}
+
+void test_quirk_profiles()
+{
+    uint16_t quirks = chip8.quirks;
+
+    // 8xy6 followed by 8xy1
+    chip8_load_instr(&chip8, 0x8126);
+    chip8.RAM[chip8.pc_start_addr + 2] = 0x81;
+    chip8.RAM[chip8.pc_start_addr + 3] = 0x21;
+    chip8_invalidate_code(&chip8, chip8.pc_start_addr + 2, 2);
+
+    // Legacy: shift Vy, logical operations reset VF.
+    chip8_set_quirks(&chip8, QUIRKS_LEGACY);
+    chip8.PC = chip8.pc_start_addr;
+    chip8.V[1] = 0x10;
+    chip8.V[2] = 0x03;
+    chip8_execute(&chip8);
+    assert(chip8.V[1] == 0x01);
+    assert(chip8.V[0x0F] == 0x01);
+    chip8_execute(&chip8);
+    assert(chip8.V[1] == 0x03);
+    assert(chip8.V[0x0F] == 0x00);
+
+    // S-CHIP: shift Vx, logical operations leave VF alone.
+    chip8_set_quirks(&chip8, QUIRKS_SCHIP);
+    chip8.PC = chip8.pc_start_addr;
+    chip8.V[1] = 0x10;
+    chip8.V[2] = 0x03;
+    chip8_execute(&chip8);
+    assert(chip8.V[1] == 0x08);
+    assert(chip8.V[0x0F] == 0x00);
+    chip8.V[0x0F] = 0x01;
+    chip8_execute(&chip8);
+    assert(chip8.V[1] == 0x0B);
+    assert(chip8.V[0x0F] == 0x01);
+
+    // XO-CHIP: shift Vy, logical operations leave VF alone.
+    chip8_set_quirks(&chip8, QUIRKS_XOCHIP);
+    chip8.PC = chip8.pc_start_addr;
+    chip8.V[1] = 0x10;
+    chip8.V[2] = 0x03;
+    chip8_execute(&chip8);
+    assert(chip8.V[1] == 0x01);
+    assert(chip8.V[0x0F] == 0x01);
+    chip8_execute(&chip8);
+    assert(chip8.V[1] == 0x03);
+    assert(chip8.V[0x0F] == 0x01);
+
+    chip8_set_quirks(&chip8, quirks);
+    chip8_reset(&chip8);
+}
+
+void test_dirty_rows()
+{
+    // A reset display is entirely dirty.
+    assert(chip8_get_dirty_rows(&chip8) == DISPLAY_ALL_ROWS);
+    chip8_clear_dirty_rows(&chip8);
+    assert(chip8_get_dirty_rows(&chip8) == 0);
+
+    // A 3-row lores sprite dirties 6 display rows.
+    chip8_load_instr(&chip8, 0xD013);
+    chip8.RAM[0x300] = 0x80;
+    chip8.I = 0x300;
+    chip8.V[0] = 0;
+    chip8.V[1] = 5;
+    chip8_execute(&chip8);
+    assert(chip8_get_dirty_rows(&chip8) == ((uint64_t)0x3F << 10));
+    chip8_clear_dirty_rows(&chip8);
+
+    // Scrolls dirty every row, unless nothing moves.
+    chip8_scroll(&chip8, 0, 1, 0, BPBOTH);
+    assert(chip8_get_dirty_rows(&chip8) == 0);
+    chip8_scroll(&chip8, 1, 0, 4, BP1);
+    assert(chip8_get_dirty_rows(&chip8) == DISPLAY_ALL_ROWS);
+
+    chip8_reset(&chip8);
+}
+
+void test_lores_native()
+{
+    // A blank lores display draws at native resolution.
+    assert(chip8.lores_native);
+
+    // 8x1 sprite clipped at the right edge.
+    chip8_load_instr(&chip8, 0xD011);
+    chip8.RAM[0x300] = 0xFF;
+    chip8.I = 0x300;
+    chip8.V[0] = LORES_WIDTH - 4;
+    chip8.V[1] = 2;
+    chip8_execute(&chip8);
+
+    assert(chip8.lores_native);
+    assert(chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 8, 4));
+    assert(chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 5));
+    assert(!chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 9, 4));
+    assert(!chip8_get_pixel(&chip8, BP1, 0, 4));
+
+    // The display itself is only brought up to date on request.
+    assert(chip8.display[4][1] == 0);
+    chip8_sync_display(&chip8);
+    assert(chip8.display[4][1] == 0xFF);
+    assert(chip8.display[5][1] == 0xFF);
+    assert(chip8.display[6][1] == 0);
+
+    // Scrolling by whole lores pixels stays native.
+    chip8_scroll(&chip8, -1, 0, 4, BP1);
+    assert(chip8.lores_native);
+    assert(chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 12, 4));
+    assert(!chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 4));
+
+    // Scrolling by half of one doesn't.
+    chip8_scroll(&chip8, 0, 1, 1, BP1);
+    assert(!chip8.lores_native);
+    assert(!chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 12, 4));
+    assert(chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 12, 5));
+    assert(chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 12, 6));
+
+    // Until the display is cleared.
+    chip8_reset_display(&chip8, BP1);
+    assert(chip8.lores_native);
+
+    // Switching to hires without clearing keeps the lores pixels.
+    chip8.PC = PC_START_ADDR_DEFAULT;
+    chip8_execute(&chip8);
+    chip8_set_hires(&chip8, true);
+    assert(!chip8.lores_native);
+    assert(chip8.display[4][1] == 0xFF);
+    assert(chip8.display[5][1] == 0xFF);
+
+    chip8_reset(&chip8);
+}
+
+void test_timer_accounting()
+{
+    chip8_set_timer_freq(&chip8, 60);
+    chip8_set_refresh_freq(&chip8, 60);
+    chip8.DT = 100;
+
+    // A third of a timer period per cycle.
+    chip8_set_cycle_time(&chip8, 1, 180);
+    chip8_handle_timers(&chip8);
+    chip8_handle_timers(&chip8);
+    assert(chip8.DT == 100);
+    chip8_handle_timers(&chip8);
+    assert(chip8.DT == 99);
+    assert(chip8.display_updated);
+
+    // 5 ms isn't a whole fraction of a period, yet no time is lost.
+    chip8_set_cycle_time(&chip8, 5000, ONE_SEC);
+    int refreshes = 0;
+    for (int i = 0; i < 50; i++)
+    {
+        chip8_handle_timers(&chip8);
+        refreshes += chip8.display_updated;
+    }
+    assert(chip8.DT == 84);
+    assert(refreshes == 15);
+
+    chip8_set_timer_freq(&chip8, TIMER_FREQ_DEFAULT);
+    chip8_set_refresh_freq(&chip8, REFRESH_FREQ_DEFAULT);
+    chip8_reset(&chip8);
+}
+
+void test_deterministic()
+{
+    // Jump to itself forever.
+    const uint8_t rom[] = {0x12, 0x00};
+
+    chip8_load_rom_buffer(&chip8, rom, sizeof(rom));
+    chip8_set_cpu_freq(&chip8, 1000);
+    chip8_set_timer_freq(&chip8, 60);
+    chip8_set_refresh_freq(&chip8, 50);
+    chip8_set_deterministic(&chip8, true);
+    chip8.DT = 100;
+    chip8.ST = 2;
+
+    // The timers tick once every 1000 / 60 instructions, fraction carried over.
+    assert(chip8_instructions_to_event(&chip8) == 17);
+    assert(chip8_run_deterministic(&chip8, 16) == 16);
+    assert(chip8_instructions_to_event(&chip8) == 1);
+    assert(chip8.DT == 100);
+    assert(chip8.beep);
+    assert(!chip8.display_updated);
+
+    assert(chip8_run_deterministic(&chip8, 1) == 1);
+    assert(chip8.DT == 99);
+    assert(chip8.ST == 1);
+
+    // The screen refreshes on the 20th instruction.
+    assert(chip8_instructions_to_event(&chip8) == 3);
+    assert(chip8_run_deterministic(&chip8, 3) == 3);
+    assert(chip8.display_updated);
+
+    assert(chip8_run_deterministic(&chip8, 980) == 980);
+    assert(chip8.DT == 40);
+    assert(chip8.ST == 0);
+    assert(!chip8.beep);
+
+    // Single cycles count the instructions they execute the same way.
+    int cycled = 0;
+    while (cycled < 17)
+    {
+        cycled += chip8_cycle(&chip8);
+    }
+    assert(chip8.DT == 39);
+
+    chip8_set_deterministic(&chip8, false);
+    chip8_set_cpu_freq(&chip8, CPU_FREQ_DEFAULT);
+    chip8_set_timer_freq(&chip8, TIMER_FREQ_DEFAULT);
+    chip8_set_refresh_freq(&chip8, REFRESH_FREQ_DEFAULT);
+    chip8_reset(&chip8);
+}
+
+void test_load_dump()
+{
+    /* A machine loaded from a dump was never initialized, lores sprites must
+    still reach the display. */
+    static CHIP8 saved;
+    char tmp_file[] = "load_dump_test.dmp";
+    saved.PC = PC_START_ADDR_DEFAULT;
+    saved.pc_start_addr = PC_START_ADDR_DEFAULT;
+    saved.lores_native = true;
+    saved.bitplane = BP1;
+    saved.state = STATE_RUNNING;
+
+    FILE *dmp = fopen(tmp_file, "wb");
+    assert(dmp);
+    assert(fwrite(&saved, sizeof(CHIP8), 1, dmp) == 1);
+    fclose(dmp);
+
+    assert(chip8_load_dump(&chip8, tmp_file));
+    remove(tmp_file);
+
+    chip8_load_instr(&chip8, 0xD011);
+    chip8.RAM[0x300] = 0x80;
+    chip8.I = 0x300;
+    chip8_execute(&chip8);
+    chip8_sync_display(&chip8);
+
+    assert(chip8_get_pixel(&chip8, BP1, 0, 0));
+    assert(chip8.display[0][0] == 0xC000000000000000);
+    assert(chip8.display[1][0] == 0xC000000000000000);
+}
+
 int main()
 {
     bool quirks[NUM_QUIRKS] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
 
+    // Runs first, before anything initializes a machine.
+    test_load_dump();
+
     chip8_init(&chip8, CPU_FREQ_DEFAULT, TIMER_FREQ_DEFAULT,
                REFRESH_FREQ_DEFAULT, PC_START_ADDR_DEFAULT, quirks);
 
@@ -1015,6 +1449,14 @@ int main()
     test_Fx55();
     test_Fx65();
     test_Fx75_Fx85();
+    test_execute_instrs();
+    test_run();
+    test_idle_loop();
+    test_quirk_profiles();
+    test_dirty_rows();
+    test_lores_native();
+    test_deterministic();
+    test_timer_accounting();
 
     printf("All tests pass!\n");
 